@@ -0,0 +1,99 @@
+"""Timing benchmark on synthetic images, optionally against a baseline build.
+
+    python3 benchmark.py ./png2pnm [./png2pnm-baseline] [--runs=N]
+
+Every case is converted --runs times (5 by default) and the median wall time, the minor page faults and the peak
+RSS of the median run are printed. With a baseline the ratio is printed too, and the exit code is 1 when a case is
+more than 1.5 times slower, so a regression fails the run instead of only showing up in the table.
+"""
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+SLOWER = 1.5
+
+
+def chunk(name, data):
+    return struct.pack(">I", len(data)) + name + data + struct.pack(">I", zlib.crc32(name + data))
+
+
+def png(path, width, height, color, rows):
+    """rows yields the filtered rows, filter byte included"""
+    deflate = zlib.compressobj(6)
+    with open(path, "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, color, 0, 0, 0)))
+        pending = b""
+        for row in rows:
+            pending += deflate.compress(row)
+            if len(pending) >= 1 << 20:
+                f.write(chunk(b"IDAT", pending))
+                pending = b""
+        f.write(chunk(b"IDAT", pending + deflate.flush()))
+        f.write(chunk(b"IEND", b""))
+
+
+def varied(width, height, channels):
+    """All five filter types over rows of changing bytes, so neither inflate nor unfilter is trivial"""
+    patterns = [bytes([f]) + os.urandom(width * channels) for f in range(5) for _ in range(13)]
+    return (patterns[j * 7 % len(patterns)] for j in range(height))
+
+
+# name, width, height, color type, options
+CASES = [
+    # A decompressor call per row dominates when rows are a few bytes wide
+    ("narrow 4x4194304 gray", 4, 1 << 22, 0, []),
+    ("wide 4096x2048 rgb", 4096, 2048, 2, []),
+    # The same image without the huge page mappings and their prefault thread, compare the faults and the time
+    ("wide 4096x2048 rgb 4K pages", 4096, 2048, 2, ["--no-huge-pages"]),
+]
+
+
+def measure(exe, options, source, target, runs):
+    samples = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        child = subprocess.Popen([exe] + options + [source, target], stderr=subprocess.PIPE)
+        errors = child.stderr.read()
+        _, status, usage = os.wait4(child.pid, 0)
+        seconds = time.perf_counter() - start
+        child.returncode = os.waitstatus_to_exitcode(status)
+        if child.returncode != 0:
+            sys.exit("%s failed on %s: %s" % (exe, source, errors.decode().strip()))
+        samples.append((seconds, usage.ru_minflt, usage.ru_maxrss))
+    samples.sort()
+    return samples[len(samples) // 2]
+
+
+def main(argv):
+    runs = 5
+    exes = []
+    for arg in argv:
+        if arg.startswith("--runs="):
+            runs = int(arg[7:])
+        else:
+            exes.append(arg)
+    if not 1 <= len(exes) <= 2:
+        sys.exit(__doc__)
+    slower = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        target = os.path.join(tmp, "out.pnm")
+        print("%-32s %10s %10s %10s %8s" % ("case", "seconds", "faults", "rss KB", "ratio"))
+        for name, width, height, color, options in CASES:
+            source = os.path.join(tmp, "in.png")
+            png(source, width, height, color, varied(width, height, 3 if color == 2 else 1))
+            new = measure(exes[0], options, source, target, runs)
+            base = measure(exes[1], options, source, target, runs) if len(exes) == 2 else None
+            ratio = "%.2f" % (new[0] / base[0]) if base else ""
+            print("%-32s %10.3f %10d %10d %8s" % (name, new[0], new[1], new[2], ratio))
+            if base:
+                print("%-32s %10.3f %10d %10d" % ("  baseline", base[0], base[1], base[2]))
+                slower += new[0] > SLOWER * base[0]
+    return 1 if slower else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
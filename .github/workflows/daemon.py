@@ -0,0 +1,50 @@
+"""Daemon test: converts one PNG through a running png2pnm --daemon, once by path and once sent inline.
+
+    png2pnm --daemon=png.sock &
+    python3 daemon.py png.sock in.png file.pnm data.pnm
+
+The FILE request writes file.pnm and the DATA request data.pnm, both have to be answered with code 0. The outputs
+are compared with the reference by the caller.
+"""
+import socket
+import sys
+import time
+
+
+def connect(path):
+    """The daemon may still be starting, so the socket is retried for a few seconds"""
+    for _ in range(100):
+        s = socket.socket(socket.AF_UNIX)
+        try:
+            s.connect(path)
+            return s
+        except OSError:
+            s.close()
+            time.sleep(0.1)
+    sys.exit("cannot connect to %s" % path)
+
+
+def request(f, line, payload=b""):
+    f.write(line + payload)
+    f.flush()
+    reply = f.readline().decode()
+    code, _, text = reply.partition("\t")
+    if code != "0":
+        print("%s -> %s" % (line.decode().strip(), reply.strip() or "no reply"))
+        return 1
+    return 0
+
+
+def main(path, source, fileOutput, dataOutput):
+    f = connect(path).makefile("rwb")
+    with open(source, "rb") as png:
+        data = png.read()
+    failed = request(f, b"FILE %s\t%s\n" % (source.encode(), fileOutput.encode()))
+    failed += request(f, b"DATA %d\t%s\n" % (len(data), dataOutput.encode()), data)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 5:
+        sys.exit(__doc__)
+    sys.exit(main(*sys.argv[1:]))
@@ -0,0 +1,72 @@
+"""Synthetic gigapixel test: a 65536x32770 grayscale PNG, more than 2^31 bytes of filtered data.
+
+    python3 gigapixel.py generate giga.png
+    png2pnm --max-pixels=4G --max-bytes=4G --max-memory=64M giga.png - | python3 gigapixel.py check
+
+Every third row starts a ramp v, v + 1, ... with v taken from the row number, written with the Sub filter,
+the next row repeats it with Up and the one after with None. check reads the PNM from standard input and
+compares the first, the last and every 4099th row, so neither side keeps the image in memory.
+"""
+import struct
+import sys
+import zlib
+
+WIDTH = 65536
+HEIGHT = 32770
+RAMP = bytes(range(256)) * (WIDTH // 256 + 1)
+
+
+def expected(j):
+    v = ((j - j % 3) >> 4) & 0xFF
+    return RAMP[v : v + WIDTH]
+
+
+def chunk(name, data):
+    return struct.pack(">I", len(data)) + name + data + struct.pack(">I", zlib.crc32(name + data))
+
+
+def generate(path):
+    sub = bytes([1]) * (WIDTH - 1)
+    up = bytes([2]) + bytes(WIDTH)
+    deflate = zlib.compressobj(1)
+    with open(path, "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", struct.pack(">IIBBBBB", WIDTH, HEIGHT, 8, 0, 0, 0, 0)))
+        pending = b""
+        for j in range(HEIGHT):
+            if j % 3 == 0:
+                row = bytes([1, expected(j)[0]]) + sub
+            elif j % 3 == 1:
+                row = up
+            else:
+                row = b"\x00" + expected(j)
+            pending += deflate.compress(row)
+            if len(pending) >= 1 << 20:
+                f.write(chunk(b"IDAT", pending))
+                pending = b""
+        f.write(chunk(b"IDAT", pending + deflate.flush()))
+        f.write(chunk(b"IEND", b""))
+
+
+def check():
+    stream = sys.stdin.buffer
+    header = b"P5\n%d %d\n255\n" % (WIDTH, HEIGHT)
+    if stream.read(len(header)) != header:
+        print("wrong PNM header")
+        return 1
+    bad = 0
+    for j in range(HEIGHT):
+        row = stream.read(WIDTH)
+        if len(row) != WIDTH:
+            print("output ends at row %d" % j)
+            return 1
+        if (j < 64 or j >= HEIGHT - 64 or j % 4099 == 0) and row != expected(j):
+            print("row %d differs" % j)
+            bad += 1
+    if stream.read(1):
+        print("output is longer than the image")
+        return 1
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(generate(sys.argv[2]) if sys.argv[1] == "generate" else check())
@@ -1,3 +1,8 @@
+#if defined(__linux__)
+#	define _GNU_SOURCE
+#elif !defined(_WIN32)
+#	define _POSIX_C_SOURCE 200809L
+#endif
 #if defined(ZLIB)
 #	include <zlib.h>
 #elif defined(LIBDEFLATE)
@@ -9,603 +14,5493 @@
 #endif
 #include "return_codes.h"
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__linux__)
+#	include <linux/fs.h>
+#	include <linux/io_uring.h>
+#	include <linux/perf_event.h>
+#	include <sys/eventfd.h>
+#	include <sys/ioctl.h>
+#endif
+#if defined(_WIN32)
+#	include <io.h>
+#	include <windows.h>
+#else
+#	include <dirent.h>
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <poll.h>
+#	include <pthread.h>
+#	include <sched.h>
+#	include <signal.h>
+#	include <sys/mman.h>
+#	include <sys/resource.h>
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <sys/syscall.h>
+#	include <sys/un.h>
+#	include <time.h>
+#	include <unistd.h>
+#endif
+#if defined(LIBDEFLATE)
+// libdeflate can only decompress whole streams
+#	define PARTIAL_INFLATE 0
+#else
+#	define PARTIAL_INFLATE 1
+#endif
+// Default --max-bytes: images whose buffers would take more are decoded row by row, so a forged IHDR cannot make the
+// decoder allocate gigabytes before the data runs out
+#define DEFAULT_MAX_BYTES ((size_t)1 << 30)
+// Default --cache-size
+#define DEFAULT_CACHE_BYTES ((size_t)1 << 30)
+// Deflate cannot expand better than 1032:1, less IDAT data than that cannot fill the image
+#define DEFLATE_MAX_RATIO 1032
+// Heap used by the decompressor state, counted against --max-memory
+#if defined(ZLIB)
+#	define INFLATER_MEMORY (48 * 1024)
+#elif defined(LIBDEFLATE)
+#	define INFLATER_MEMORY (32 * 1024)
+#else
+#	define INFLATER_MEMORY 0
+#endif
 struct image
 {
 	unsigned char *data;
 	size_t size;
+	size_t capacity;
 	unsigned char *plteData;
 	size_t plteSize;
 	int type;
+	int interlace;
+	// Most bytes parsePNG may hold for IDAT data, 0 when unlimited
+	size_t limit;
+	// Set for streams of concatenated PNGs, where the next signature follows IEND
+	int concatenated;
+	// Input already in memory. Its IDAT chunks are not copied into data but listed as offset and length pairs
+	const unsigned char *source;
+	size_t (*chunks)[2];
+	size_t chunkCount;
+	size_t chunkCapacity;
+	// Seekable input whose IDAT chunks are left in the file and read back through window of windowSize bytes, the
+	// first chunk header is at idatOffset
+	FILE *file;
+	long idatOffset;
+	unsigned char *window;
+	size_t windowSize;
 };
-
-int inf(unsigned char *inputData, unsigned char *outputData, size_t inSize, size_t outSize)
+enum stage
 {
-#if defined(ZLIB)
-	z_stream infl;
-	infl.zalloc = Z_NULL;
-	infl.zfree = Z_NULL;
-	infl.opaque = Z_NULL;
-	infl.avail_in = inSize;
-	infl.next_in = inputData;
-	infl.avail_out = outSize;
-	infl.next_out = outputData;
-	int ret = inflateInit(&infl);
-	if (ret == Z_MEM_ERROR)
+	STAGE_SIGNATURE,
+	STAGE_IHDR,
+	STAGE_CHUNKS,
+	STAGE_CACHE,
+	STAGE_INFLATE,
+	STAGE_UNFILTER,
+	STAGE_EXPAND,
+	STAGE_WRITE,
+	STAGES
+};
+static const char *stageNames[STAGES] = {
+	"signature", "ihdr", "chunks", "cache", "inflate", "unfilter", "expand", "write",
+};
+enum counter
+{
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_LLC_MISSES,
+	COUNTERS
+};
+static const char *counterNames[COUNTERS] = { "cycles", "instructions", "branchMisses", "llcMisses" };
+struct stats
+{
+	int width;
+	int height;
+	double seconds[STAGES];
+	unsigned long long bytesIn[STAGES];
+	unsigned long long bytesOut[STAGES];
+	// Hardware counters, only meaningful when countersAvailable is set
+	int countersAvailable;
+	unsigned long long counters[STAGES][COUNTERS];
+	// Tracked heap use: allocations made in a stage and the highest process-wide usage seen while it ran
+	unsigned long long allocations[STAGES];
+	unsigned long long allocatedBytes[STAGES];
+	unsigned long long peakBytes[STAGES];
+	// Page faults of the whole process while the conversion ran
+	unsigned long long pageFaults;
+	// Whether --cache had the conversion, see enum cacheResult
+	int cache;
+};
+struct mark
+{
+	double time;
+	int counted;
+	unsigned long long counters[COUNTERS];
+	unsigned long long allocations;
+	unsigned long long allocatedBytes;
+};
+// Stats of the conversion the current thread works on, NULL when not collecting
+static _Thread_local struct stats *threadStats;
+// Set once by --counters before any conversion starts
+static int countersEnabled;
+// Counter group of the current thread, opened on first use: 0 not tried yet, -1 unavailable
+static _Thread_local int counterGroup;
+static _Thread_local int counterFds[COUNTERS];
+#if defined(__linux__)
+int openCounters(void)
+{
+	static const unsigned long long configs[COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_MISSES,
+	};
+	int leader = -1;
+	for (int i = 0; i < COUNTERS; i++)
 	{
-		return ERROR_OUT_OF_MEMORY;
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		counterFds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		if (counterFds[i] < 0)
+		{
+			for (int j = 0; j < i; j++)
+			{
+				close(counterFds[j]);
+			}
+			return -1;
+		}
+		leader = counterFds[0];
 	}
-	ret = inflate(&infl, Z_NO_FLUSH);
-	if (ret == Z_MEM_ERROR)
+	return 1;
+}
+#endif
+// Reads all counters of the current thread, returns 0 when they are not available
+int readCounters(unsigned long long values[])
+{
+#if defined(__linux__)
+	if (counterGroup == 0)
 	{
-		return ERROR_OUT_OF_MEMORY;
+		counterGroup = openCounters();
 	}
-	else if (ret != Z_STREAM_END)
+	unsigned long long group[COUNTERS + 1];
+	if (counterGroup < 0 || read(counterFds[0], group, sizeof(group)) != sizeof(group))
 	{
-		return ERROR_DATA_INVALID;
+		return 0;
 	}
-	ret = inflateEnd(&infl);
-	if (ret != Z_OK)
+	memcpy(values, group + 1, sizeof(unsigned long long) * COUNTERS);
+	return 1;
+#else
+	return 0;
+#endif
+}
+// Threads that record stages close their counters before exiting
+void closeCounters(void)
+{
+#if defined(__linux__)
+	for (int i = 0; counterGroup > 0 && i < COUNTERS; i++)
 	{
-		return ERROR_DATA_INVALID;
+		close(counterFds[i]);
 	}
-	return SUCCESS;
-#elif defined(LIBDEFLATE)
-	struct libdeflate_decompressor *de = libdeflate_alloc_decompressor();
-	if (de == NULL)
+#endif
+	counterGroup = 0;
+}
+double now(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / frequency.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+// Trace recorder: every thread appends spans to its own buffer, buffers are linked once and written after the run
+#define TRACE_MERGE_SECONDS 20e-6
+struct traceEvent
+{
+	const struct stats *stats;
+	int stage;
+	double start;
+	double end;
+};
+struct traceBuffer
+{
+	struct traceBuffer *next;
+	int tid;
+	size_t count;
+	size_t capacity;
+	size_t dropped;
+	struct traceEvent *events;
+};
+static int traceEnabled;
+static double traceOrigin;
+static _Atomic(struct traceBuffer *) traceBuffers;
+static atomic_int traceThreads;
+static _Thread_local struct traceBuffer *threadTrace;
+// Records a span of stage, or of the whole file for STAGES. Back-to-back spans of the same stage, like the
+// per-row ones of the pipeline threads, are merged so that only stalls between them remain visible
+void traceRecord(const struct stats *stats, int stage, double start, double end)
+{
+	if (!traceEnabled)
 	{
-		return ERROR_OUT_OF_MEMORY;
+		return;
 	}
-	int res = libdeflate_deflate_decompress(de, inputData + 2, inSize - 6, outputData, outSize, NULL);
-	if (res != LIBDEFLATE_SUCCESS)
+	struct traceBuffer *b = threadTrace;
+	if (b == NULL)
 	{
-		return ERROR_DATA_INVALID;
+		b = calloc(1, sizeof(struct traceBuffer));
+		if (b == NULL)
+		{
+			return;
+		}
+		(*b).tid = atomic_fetch_add(&traceThreads, 1) + 1;
+		(*b).next = atomic_load(&traceBuffers);
+		while (!atomic_compare_exchange_weak(&traceBuffers, &(*b).next, b))
+		{
+		}
+		threadTrace = b;
 	}
-	return SUCCESS;
-#elif defined(ISAL)
-	struct inflate_state infl;
-	isal_inflate_init(&infl);
-	infl.avail_in = inSize - 6;
-	infl.next_in = inputData + 2;
-	infl.avail_out = outSize;
-	infl.next_out = outputData;
-	int x = isal_inflate(&infl);
-	if (x != ISAL_DECOMP_OK)
+	struct traceEvent *last = (*b).count > 0 ? &(*b).events[(*b).count - 1] : NULL;
+	if (last != NULL && (*last).stats == stats && (*last).stage == stage && start - (*last).end < TRACE_MERGE_SECONDS)
 	{
-		return ERROR_DATA_INVALID;
+		(*last).end = end;
+		return;
+	}
+	if ((*b).count == (*b).capacity)
+	{
+		size_t capacity = (*b).capacity == 0 ? 1024 : (*b).capacity * 2;
+		struct traceEvent *events = realloc((*b).events, capacity * sizeof(struct traceEvent));
+		if (events == NULL)
+		{
+			(*b).dropped++;
+			return;
+		}
+		(*b).events = events;
+		(*b).capacity = capacity;
+	}
+	(*b).events[(*b).count++] = (struct traceEvent){ stats, stage, start, end };
+}
+// Image buffers go through allocate/reallocate/release, which keep a size header in front of every block so that
+// the process-wide current and peak usage stay exact
+union allocation
+{
+	struct
+	{
+		size_t size;
+		// Set for blocks that have a mapping of their own, see mapBlock
+		size_t mapped;
+	} info;
+	max_align_t align;
+};
+static atomic_ullong memoryCurrent;
+static atomic_ullong memoryPeak;
+static _Thread_local unsigned long long threadAllocations;
+static _Thread_local unsigned long long threadAllocated;
+static _Thread_local unsigned long long threadPeak;
+void memoryAdd(size_t size)
+{
+	unsigned long long current = atomic_fetch_add(&memoryCurrent, size) + size;
+	unsigned long long peak = atomic_load(&memoryPeak);
+	while (current > peak && !atomic_compare_exchange_weak(&memoryPeak, &peak, current))
+	{
+	}
+	threadAllocations++;
+	threadAllocated += size;
+	threadPeak = current > threadPeak ? current : threadPeak;
+}
+// Cleared by --no-huge-pages
+static int hugePages = 1;
+#if defined(__linux__)
+// Blocks of HUGE_BLOCK bytes and more (IDAT data, out1 and out2 of big images) get a mapping of their own that is
+// backed by 2 MB pages when the system has them. One long-lived helper thread populates the queued mappings while
+// their callers start filling them, so first-touch page faults overlap with inflate instead of stalling it
+#	define HUGE_BLOCK ((size_t)4 << 20)
+#	define HUGE_PAGE ((size_t)2 << 20)
+#	define MAP_HEADER 64
+// Linux 5.14, older C libraries lack the name and older kernels fail the call, which only skips the prefault
+#	if !defined(MADV_POPULATE_WRITE)
+#		define MADV_POPULATE_WRITE 23
+#	endif
+struct mapHeader
+{
+	size_t length;
+	// Next mapping in the prefault queue
+	struct mapHeader *next;
+	int queued;
+};
+_Static_assert(sizeof(struct mapHeader) + sizeof(union allocation) <= MAP_HEADER, "MAP_HEADER is too small");
+// Mappings waiting for the prefault thread, which is started with the first one. A mapping is unmapped or resized
+// only after it has left the queue and the thread is done with it
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	struct mapHeader *first;
+	struct mapHeader *last;
+	struct mapHeader *running;
+	int started;
+} prefaults = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+void *prefaultThread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&prefaults.lock);
+	for (;;)
+	{
+		while (prefaults.first == NULL)
+		{
+			pthread_cond_wait(&prefaults.queued, &prefaults.lock);
+		}
+		struct mapHeader *h = prefaults.first;
+		prefaults.first = (*h).next;
+		(*h).queued = 0;
+		prefaults.running = h;
+		pthread_mutex_unlock(&prefaults.lock);
+		madvise(h, (*h).length, MADV_POPULATE_WRITE);
+		pthread_mutex_lock(&prefaults.lock);
+		prefaults.running = NULL;
+		pthread_cond_broadcast(&prefaults.done);
+	}
+	return NULL;
+}
+void prefaultStart(struct mapHeader *h)
+{
+	pthread_mutex_lock(&prefaults.lock);
+	if (!prefaults.started)
+	{
+		pthread_t thread;
+		prefaults.started = pthread_create(&thread, NULL, prefaultThread, NULL) == 0 ? 1 : -1;
+		if (prefaults.started == 1)
+		{
+			pthread_detach(thread);
+		}
+	}
+	if (prefaults.started == 1)
+	{
+		(*h).next = NULL;
+		(*h).queued = 1;
+		if (prefaults.first == NULL)
+		{
+			prefaults.first = h;
+		}
+		else
+		{
+			(*prefaults.last).next = h;
+		}
+		prefaults.last = h;
+		pthread_cond_signal(&prefaults.queued);
+	}
+	pthread_mutex_unlock(&prefaults.lock);
+}
+// Takes a mapping that is still queued off the queue, its pages are then faulted in by whoever touches them
+void prefaultWait(struct mapHeader *h)
+{
+	pthread_mutex_lock(&prefaults.lock);
+	if ((*h).queued)
+	{
+		struct mapHeader **link = &prefaults.first;
+		struct mapHeader *before = NULL;
+		while (*link != h)
+		{
+			before = *link;
+			link = &(**link).next;
+		}
+		*link = (*h).next;
+		if (prefaults.last == h)
+		{
+			prefaults.last = before;
+		}
+		(*h).queued = 0;
+	}
+	while (prefaults.running == h)
+	{
+		pthread_cond_wait(&prefaults.done, &prefaults.lock);
+	}
+	pthread_mutex_unlock(&prefaults.lock);
+}
+size_t mapLength(size_t size)
+{
+	return (MAP_HEADER + size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+union allocation *mapBlock(size_t size)
+{
+	size_t length = mapLength(size);
+	void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+		{
+			return NULL;
+		}
+		madvise(base, length, MADV_HUGEPAGE);
+	}
+	struct mapHeader *h = base;
+	(*h).length = length;
+	prefaultStart(h);
+	union allocation *a = (union allocation *)((unsigned char *)base + MAP_HEADER) - 1;
+	(*a).info.mapped = 1;
+	return a;
+}
+struct mapHeader *mapOf(union allocation *a)
+{
+	return (struct mapHeader *)((unsigned char *)(a + 1) - MAP_HEADER);
+}
+void unmapBlock(union allocation *a)
+{
+	struct mapHeader *h = mapOf(a);
+	prefaultWait(h);
+	munmap(h, (*h).length);
+}
+// Grows or shrinks a mapped block in place when the kernel can, otherwise moves it
+union allocation *remapBlock(union allocation *a, size_t size)
+{
+	struct mapHeader *h = mapOf(a);
+	prefaultWait(h);
+	size_t length = mapLength(size);
+	void *base = mremap(h, (*h).length, length, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED)
+	{
+		return NULL;
+	}
+	h = base;
+	(*h).length = length;
+	prefaultStart(h);
+	return (union allocation *)((unsigned char *)base + MAP_HEADER) - 1;
+}
+#endif
+void *allocate(size_t size)
+{
+	union allocation *a = NULL;
+#if defined(__linux__)
+	if (hugePages && size >= HUGE_BLOCK && size <= SIZE_MAX - HUGE_PAGE - MAP_HEADER)
+	{
+		a = mapBlock(size);
 	}
-	return SUCCESS;
 #endif
+	if (a == NULL)
+	{
+		a = size > SIZE_MAX - sizeof(union allocation) ? NULL : malloc(sizeof(union allocation) + size);
+		if (a == NULL)
+		{
+			return NULL;
+		}
+		(*a).info.mapped = 0;
+	}
+	(*a).info.size = size;
+	memoryAdd(size);
+	return a + 1;
 }
-struct ihdrRet
+void release(void *p)
 {
-	char *text;
-	int returnCode;
-	int type;
+	if (p != NULL)
+	{
+		union allocation *a = (union allocation *)p - 1;
+		atomic_fetch_sub(&memoryCurrent, (*a).info.size);
+#if defined(__linux__)
+		if ((*a).info.mapped)
+		{
+			unmapBlock(a);
+			return;
+		}
+#endif
+		free(a);
+	}
+}
+void *reallocate(void *p, size_t size)
+{
+	if (p == NULL)
+	{
+		return allocate(size);
+	}
+	union allocation *a = (union allocation *)p - 1;
+	size_t old = (*a).info.size;
+#if defined(__linux__)
+	if ((*a).info.mapped || (hugePages && size >= HUGE_BLOCK))
+	{
+		// Crossing HUGE_BLOCK moves the data into a mapping, mapped blocks are resized by mremap
+		unsigned char *q = NULL;
+		if ((*a).info.mapped && size <= SIZE_MAX - HUGE_PAGE - MAP_HEADER)
+		{
+			a = remapBlock(a, size);
+			q = a == NULL ? NULL : (unsigned char *)(a + 1);
+		}
+		else if (!(*a).info.mapped)
+		{
+			q = allocate(size);
+			if (q != NULL)
+			{
+				memcpy(q, p, old < size ? old : size);
+				release(p);
+				return q;
+			}
+		}
+		if (q == NULL)
+		{
+			return NULL;
+		}
+		(*a).info.size = size;
+		atomic_fetch_sub(&memoryCurrent, old);
+		memoryAdd(size);
+		return q;
+	}
+#endif
+	a = size > SIZE_MAX - sizeof(union allocation) ? NULL : realloc(a, sizeof(union allocation) + size);
+	if (a == NULL)
+	{
+		return NULL;
+	}
+	(*a).info.size = size;
+	atomic_fetch_sub(&memoryCurrent, old);
+	memoryAdd(size);
+	return a + 1;
+}
+// Bump allocator for the per-image buffers of one worker: chunk data, palette, rows and ring slots. An image that
+// does not fit gets overflow blocks, and the next reset replaces the block with one big enough for both
+#define ARENA_ALIGN sizeof(union allocation)
+struct arenaBlock
+{
+	struct arenaBlock *next;
+	union allocation data[];
 };
-struct ihdrRet ihdrChunk(FILE *f, struct image *bu, int *pars)
+struct arena
 {
-	unsigned char buf[10];
-	struct ihdrRet ans = { 0, SUCCESS, 0 };
-	int ret = fread(buf, 1, 8, f);
-	if (ret != 8)
+	unsigned char *block;
+	size_t capacity;
+	size_t used;
+	struct arenaBlock *overflow;
+	size_t overflowSize;
+};
+// Arena of the conversion the current thread works on
+static _Thread_local struct arena *threadArena;
+void *arenaAlloc(struct arena *a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if (size <= (*a).capacity - (*a).used)
 	{
-		ans.text = "Read less bytes expected 8\n";
-		ans.returnCode = ERROR_DATA_INVALID;
-		return ans;
+		void *p = (*a).block + (*a).used;
+		(*a).used += size;
+		return p;
 	}
-	int size = buf[3] + buf[2] * 16 * 16 + buf[1] * 16 * 16 * 16 * 16 + buf[0] * 16 * 16 * 16 * 16 * 16 * 16;
-	if (size != 13)
+	if (size > SIZE_MAX - sizeof(struct arenaBlock))
 	{
-		ans.text = "Wrong IHDR chunk size\n";
-		ans.returnCode = ERROR_DATA_INVALID;
-		return ans;
+		return NULL;
 	}
-	char name[8] = { buf[4] & 0xFF, buf[5] & 0xFF, buf[6] & 0xFF, buf[7] & 0xFF };
-	if (strcmp("IHDR", name) != 0)
+	struct arenaBlock *b = allocate(sizeof(struct arenaBlock) + size);
+	if (b == NULL)
 	{
-		ans.text = "Error wrong name of the first chunk\n";
-		ans.returnCode = ERROR_DATA_INVALID;
-		return ans;
+		return NULL;
 	}
-	ret = fread(buf, 1, 8, f);
-	if (ret != 8)
+	(*b).next = (*a).overflow;
+	(*a).overflow = b;
+	(*a).overflowSize += size;
+	return (*b).data;
+}
+// Drops everything allocated since the last reset, O(1) unless the previous image overflowed the block
+void arenaReset(struct arena *a)
+{
+	if ((*a).overflow != NULL)
 	{
-		ans.text = "Wrong width and height\n";
-		ans.returnCode = ERROR_DATA_INVALID;
-		return ans;
+		while ((*a).overflow != NULL)
+		{
+			struct arenaBlock *next = (*(*a).overflow).next;
+			release((*a).overflow);
+			(*a).overflow = next;
+		}
+		size_t capacity = (*a).used + (*a).overflowSize;
+		release((*a).block);
+		(*a).block = allocate(capacity);
+		(*a).capacity = (*a).block == NULL ? 0 : capacity;
+		(*a).overflowSize = 0;
 	}
-	int width = 0;
-	int height = 0;
-	int umn = 1;
-	for (int i = 0; i < 4; i++)
+	(*a).used = 0;
+}
+void arenaFree(struct arena *a)
+{
+	arenaReset(a);
+	release((*a).block);
+	(*a).block = NULL;
+	(*a).capacity = 0;
+	if (threadArena == a)
 	{
-		width += (buf[3 - i] & 0xFF) * umn;
-		height += (buf[7 - i] & 0xFF) * umn;
-		umn *= (16 * 16);
+		threadArena = NULL;
 	}
-	pars[0] = width;
-	pars[1] = height;
-	fread(buf, 1, 9, f);
-	if (buf[0] != 8)
+}
+#if defined(ZLIB)
+voidpf zlibAllocate(voidpf opaque, uInt items, uInt size)
+{
+	(void)opaque;
+	return (size_t)items * size > SIZE_MAX / 2 ? Z_NULL : allocate((size_t)items * size);
+}
+void zlibRelease(voidpf opaque, voidpf p)
+{
+	(void)opaque;
+	release(p);
+}
+#endif
+unsigned long long pageFaults(void)
+{
+#if defined(_WIN32)
+	return 0;
+#else
+	struct rusage usage;
+	return getrusage(RUSAGE_SELF, &usage) == 0 ? (unsigned long long)usage.ru_minflt + usage.ru_majflt : 0;
+#endif
+}
+struct mark stageStart(void)
+{
+	struct mark m = { 0 };
+	if (threadStats != NULL)
 	{
-		ans.text = "Only support 8 bit depth images\n";
-		ans.returnCode = ERROR_UNSUPPORTED;
-		return ans;
+		m.counted = countersEnabled && readCounters(m.counters);
+		m.allocations = threadAllocations;
+		m.allocatedBytes = threadAllocated;
+		threadPeak = atomic_load(&memoryCurrent);
+		m.time = now();
 	}
-	if (buf[2] != 0)
+	return m;
+}
+void stageEnd(enum stage stage, struct mark start, size_t bytesIn, size_t bytesOut)
+{
+	if (threadStats != NULL)
 	{
-		ans.text = "Only deflate algorithm with value 0\n";
-		ans.returnCode = ERROR_DATA_INVALID;
-		return ans;
+		double end = now();
+		traceRecord(threadStats, stage, start.time, end);
+		(*threadStats).seconds[stage] += end - start.time;
+		(*threadStats).bytesIn[stage] += bytesIn;
+		(*threadStats).bytesOut[stage] += bytesOut;
+		(*threadStats).allocations[stage] += threadAllocations - start.allocations;
+		(*threadStats).allocatedBytes[stage] += threadAllocated - start.allocatedBytes;
+		if (threadPeak > (*threadStats).peakBytes[stage])
+		{
+			(*threadStats).peakBytes[stage] = threadPeak;
+		}
+		unsigned long long values[COUNTERS];
+		if (start.counted && readCounters(values))
+		{
+			(*threadStats).countersAvailable = 1;
+			for (int i = 0; i < COUNTERS; i++)
+			{
+				(*threadStats).counters[stage][i] += values[i] - start.counters[i];
+			}
+		}
 	}
-	if (buf[3] != 0)
+}
+
+// Reads the compressed data of an image back in pieces: the data collected by parsePNG, the IDAT chunks of an
+// input that is already in memory, which are used in place, or those of a file, read a window at a time
+struct idatReader
+{
+	struct image *buf;
+	size_t chunk;
+	size_t done;
+	// File offset of the next chunk header and the bytes left of the current chunk
+	long next;
+	size_t left;
+	// Zlib header bytes still to drop, the ISA-L decompressor takes raw deflate
+	size_t skip;
+	int ended;
+};
+// Zlib and ISA-L count input in 32-bit units
+#define IDAT_PIECE ((size_t)1 << 30)
+#define IDAT_WINDOW ((size_t)64 << 10)
+// Window for budgets too small for IDAT_WINDOW
+#define IDAT_WINDOW_MIN ((size_t)4 << 10)
+void idatStart(struct idatReader *r, struct image *buf)
+{
+	*r = (struct idatReader){ .buf = buf, .next = (*buf).idatOffset };
+}
+// Next piece of the IDAT chunks left in the file. They are consecutive, so the chunk headers are followed from the
+// first one without keeping a list
+void idatNextFile(struct idatReader *r, const unsigned char **data, size_t *size)
+{
+	struct image *buf = (*r).buf;
+	while ((*r).left == 0)
 	{
-		ans.text = "There is only 1 filtration method with value 0\n";
-		ans.returnCode = ERROR_DATA_INVALID;
-		return ans;
+		unsigned char head[8];
+		if (fseek((*buf).file, (*r).next, SEEK_SET) != 0 || fread(head, 1, 8, (*buf).file) != 8 ||
+			memcmp(head + 4, "IDAT", 4) != 0)
+		{
+			(*r).ended = 1;
+			return;
+		}
+		(*r).left = (size_t)head[0] << 24 | (size_t)head[1] << 16 | (size_t)head[2] << 8 | head[3];
+		(*r).next += 12 + (long)(*r).left;
+	}
+	*size = (*r).left < (*buf).windowSize ? (*r).left : (*buf).windowSize;
+	if (fread((*buf).window, 1, *size, (*buf).file) != *size)
+	{
+		// A file cut short ends the data, inflate then reports it as invalid
+		*size = 0;
+		(*r).ended = 1;
+		return;
+	}
+	*data = (*buf).window;
+	(*r).left -= *size;
+}
+// Next piece of compressed data, *size is 0 once everything was read
+void idatNext(struct idatReader *r, const unsigned char **data, size_t *size)
+{
+	struct image *buf = (*r).buf;
+	size_t count = (*buf).chunks == NULL ? 1 : (*buf).chunkCount;
+	*size = 0;
+	if ((*buf).file != NULL)
+	{
+		idatNextFile(r, data, size);
+		return;
+	}
+	if ((*r).chunk >= count)
+	{
+		(*r).ended = 1;
+		return;
+	}
+	size_t offset = (*buf).chunks == NULL ? 0 : (*buf).chunks[(*r).chunk][0];
+	size_t length = (*buf).chunks == NULL ? (*buf).size : (*buf).chunks[(*r).chunk][1];
+	*size = length - (*r).done < IDAT_PIECE ? length - (*r).done : IDAT_PIECE;
+	*data = ((*buf).chunks == NULL ? (*buf).data : (*buf).source) + offset + (*r).done;
+	(*r).done += *size;
+	if ((*r).done == length)
+	{
+		(*r).chunk++;
+		(*r).done = 0;
+	}
+}
+struct inflater
+{
+#if defined(ZLIB)
+	z_stream infl;
+	int ready;
+#elif defined(LIBDEFLATE)
+	struct libdeflate_decompressor *de;
+	unsigned char *whole;
+	size_t pos;
+	size_t size;
+#elif defined(ISAL)
+	struct inflate_state infl;
+#endif
+	struct idatReader in;
+};
+// Hands the decompressor the next piece of input once it has used up the previous one
+void inflaterFeed(struct inflater *s)
+{
+	const unsigned char *data = NULL;
+	size_t size = 0;
+	do
+	{
+		idatNext(&(*s).in, &data, &size);
+		size_t skip = (*s).in.skip < size ? (*s).in.skip : size;
+		(*s).in.skip -= skip;
+		data += skip;
+		size -= skip;
+	} while (size == 0 && !(*s).in.ended);
+#if defined(ZLIB)
+	(*s).infl.next_in = (z_const Bytef *)data;
+	(*s).infl.avail_in = size;
+#elif defined(ISAL)
+	(*s).infl.next_in = (uint8_t *)data;
+	(*s).infl.avail_in = size;
+#endif
+}
+// Starts a new stream over the compressed data of buf, the decompressor itself is kept between streams until
+// inflaterFree
+int inflaterStart(struct inflater *s, struct image *buf)
+{
+	idatStart(&(*s).in, buf);
+#if defined(ZLIB)
+	(*s).infl.avail_in = 0;
+	(*s).infl.next_in = Z_NULL;
+	if ((*s).ready)
+	{
+		return inflateReset(&(*s).infl) == Z_OK ? SUCCESS : ERROR_DATA_INVALID;
+	}
+	(*s).infl.zalloc = zlibAllocate;
+	(*s).infl.zfree = zlibRelease;
+	(*s).infl.opaque = Z_NULL;
+	int ret = inflateInit(&(*s).infl);
+	if (ret == Z_MEM_ERROR)
+	{
+		return ERROR_OUT_OF_MEMORY;
+	}
+	else if (ret != Z_OK)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	(*s).ready = 1;
+	return SUCCESS;
+#elif defined(LIBDEFLATE)
+	if ((*s).de == NULL)
+	{
+		(*s).de = libdeflate_alloc_decompressor();
+	}
+	return (*s).de == NULL ? ERROR_OUT_OF_MEMORY : SUCCESS;
+#elif defined(ISAL)
+	isal_inflate_init(&(*s).infl);
+	(*s).in.skip = 2;
+	return SUCCESS;
+#endif
+}
+void inflaterFree(struct inflater *s)
+{
+#if defined(ZLIB)
+	if ((*s).ready)
+	{
+		inflateEnd(&(*s).infl);
+		(*s).ready = 0;
+	}
+#elif defined(LIBDEFLATE)
+	if ((*s).de != NULL)
+	{
+		libdeflate_free_decompressor((*s).de);
+		(*s).de = NULL;
+	}
+#endif
+}
+// partial != 0 allows stopping once outputData is full, before the end of the stream
+int inf(struct inflater *s, struct image *buf, unsigned char *outputData, size_t outSize, int partial)
+{
+	int ret = inflaterStart(s, buf);
+	if (ret != SUCCESS)
+	{
+		return ret;
+	}
+#if defined(ZLIB)
+	(*s).infl.avail_out = outSize;
+	(*s).infl.next_out = outputData;
+	do
+	{
+		if ((*s).infl.avail_in == 0)
+		{
+			inflaterFeed(s);
+		}
+		ret = inflate(&(*s).infl, Z_NO_FLUSH);
+	} while (ret == Z_OK && !(partial && (*s).infl.avail_out == 0));
+	if (ret == Z_MEM_ERROR)
+	{
+		return ERROR_OUT_OF_MEMORY;
+	}
+	else if (partial && (ret == Z_OK || ret == Z_BUF_ERROR) && (*s).infl.avail_out == 0)
+	{
+		return SUCCESS;
+	}
+	else if (ret != Z_STREAM_END)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+#elif defined(LIBDEFLATE)
+	// libdeflate needs the whole stream in one piece, chunks used in place are gathered first
+	unsigned char *input = (*buf).data;
+	if ((*buf).chunks != NULL)
+	{
+		input = allocate((*buf).size);
+		if (input == NULL)
+		{
+			return ERROR_OUT_OF_MEMORY;
+		}
+		const unsigned char *data;
+		size_t size;
+		size_t at = 0;
+		idatNext(&(*s).in, &data, &size);
+		while (size > 0)
+		{
+			memcpy(input + at, data, size);
+			at += size;
+			idatNext(&(*s).in, &data, &size);
+		}
+	}
+	int res = LIBDEFLATE_BAD_DATA;
+	if ((*buf).size >= 6)
+	{
+		res = libdeflate_deflate_decompress((*s).de, input + 2, (*buf).size - 6, outputData, outSize, NULL);
+	}
+	if (input != (*buf).data)
+	{
+		release(input);
+	}
+	if (res != LIBDEFLATE_SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+#elif defined(ISAL)
+	(*s).infl.avail_out = outSize;
+	(*s).infl.next_out = outputData;
+	int x = ISAL_DECOMP_OK;
+	while (x == ISAL_DECOMP_OK && (*s).infl.block_state != ISAL_BLOCK_FINISH && (*s).infl.avail_out != 0)
+	{
+		if ((*s).infl.avail_in == 0)
+		{
+			inflaterFeed(s);
+		}
+		if ((*s).infl.avail_in == 0)
+		{
+			break;
+		}
+		x = isal_inflate(&(*s).infl);
+	}
+	if (x != ISAL_DECOMP_OK)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+#endif
+}
+// Incremental counterpart of inf, outSize is the size of the whole decompressed stream
+int inflaterInit(struct inflater *s, struct image *buf, size_t outSize)
+{
+#if defined(LIBDEFLATE)
+	(*s).whole = allocate(outSize);
+	(*s).pos = 0;
+	(*s).size = outSize;
+	if ((*s).whole == NULL)
+	{
+		return ERROR_OUT_OF_MEMORY;
+	}
+	int ret = inf(s, buf, (*s).whole, outSize, 0);
+	if (ret != SUCCESS)
+	{
+		release((*s).whole);
+		(*s).whole = NULL;
+	}
+	return ret;
+#else
+	return inflaterStart(s, buf);
+#endif
+}
+int inflaterRead(struct inflater *s, unsigned char *outputData, size_t outSize)
+{
+#if defined(ZLIB)
+	(*s).infl.avail_out = outSize;
+	(*s).infl.next_out = outputData;
+	while ((*s).infl.avail_out != 0)
+	{
+		if ((*s).infl.avail_in == 0)
+		{
+			inflaterFeed(s);
+		}
+		int ret = inflate(&(*s).infl, Z_NO_FLUSH);
+		if (ret == Z_MEM_ERROR)
+		{
+			return ERROR_OUT_OF_MEMORY;
+		}
+		else if (ret != Z_OK)
+		{
+			break;
+		}
+	}
+	return (*s).infl.avail_out == 0 ? SUCCESS : ERROR_DATA_INVALID;
+#elif defined(LIBDEFLATE)
+	if ((*s).size - (*s).pos < outSize)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	memcpy(outputData, (*s).whole + (*s).pos, outSize);
+	(*s).pos += outSize;
+	return SUCCESS;
+#elif defined(ISAL)
+	(*s).infl.avail_out = outSize;
+	(*s).infl.next_out = outputData;
+	int x = ISAL_DECOMP_OK;
+	while (x == ISAL_DECOMP_OK && (*s).infl.avail_out != 0 && (*s).infl.block_state != ISAL_BLOCK_FINISH)
+	{
+		if ((*s).infl.avail_in == 0)
+		{
+			inflaterFeed(s);
+		}
+		if ((*s).infl.avail_in == 0)
+		{
+			break;
+		}
+		x = isal_inflate(&(*s).infl);
+	}
+	if (x != ISAL_DECOMP_OK || (*s).infl.avail_out != 0)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+#endif
+}
+void inflaterEnd(struct inflater *s)
+{
+#if defined(LIBDEFLATE)
+	release((*s).whole);
+	(*s).whole = NULL;
+#endif
+}
+struct ihdrRet
+{
+	char *text;
+	int returnCode;
+	int type;
+};
+struct ihdrRet ihdrChunk(FILE *f, struct image *bu, int *pars)
+{
+	unsigned char buf[10];
+	struct ihdrRet ans = { 0, SUCCESS, 0 };
+	int ret = fread(buf, 1, 8, f);
+	if (ret != 8)
+	{
+		ans.text = "Read less bytes expected 8\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	int size = buf[3] + buf[2] * 16 * 16 + buf[1] * 16 * 16 * 16 * 16 + buf[0] * 16 * 16 * 16 * 16 * 16 * 16;
+	if (size != 13)
+	{
+		ans.text = "Wrong IHDR chunk size\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	char name[8] = { buf[4] & 0xFF, buf[5] & 0xFF, buf[6] & 0xFF, buf[7] & 0xFF };
+	if (strcmp("IHDR", name) != 0)
+	{
+		ans.text = "Error wrong name of the first chunk\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	ret = fread(buf, 1, 8, f);
+	if (ret != 8)
+	{
+		ans.text = "Wrong width and height\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	unsigned long width = 0;
+	unsigned long height = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		width = width << 8 | buf[i];
+		height = height << 8 | buf[4 + i];
+	}
+	if (width == 0 || height == 0 || width > 0x7FFFFFFF || height > 0x7FFFFFFF)
+	{
+		ans.text = "Width and height must be from 1 to 2^31-1\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	pars[0] = width;
+	pars[1] = height;
+	fread(buf, 1, 9, f);
+	if (buf[0] != 8)
+	{
+		ans.text = "Only support 8 bit depth images\n";
+		ans.returnCode = ERROR_UNSUPPORTED;
+		return ans;
+	}
+	if (buf[2] != 0)
+	{
+		ans.text = "Only deflate algorithm with value 0\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	if (buf[3] != 0)
+	{
+		ans.text = "There is only 1 filtration method with value 0\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	if (buf[4] > 1)
+	{
+		ans.text = "Unknown interlace method\n";
+		ans.returnCode = ERROR_DATA_INVALID;
+		return ans;
+	}
+	(*bu).interlace = buf[4];
+	(*bu).type = buf[1];
+	if (buf[1] == 0 || buf[1] == 3)
+	{
+		ans.type = 1;
+		ans.returnCode = SUCCESS;
+		return ans;
+	}
+	else if (buf[1] == 2)
+	{
+		ans.type = 3;
+		ans.returnCode = SUCCESS;
+		return ans;
+	}
+	else
+	{
+		ans.text = "Only color types 0, 2, 3 are supported\n";
+		ans.returnCode = ERROR_UNSUPPORTED;
+		return ans;
+	}
+}
+struct pair
+{
+	char *text;
+	int returnCode;
+};
+void makeError(struct pair *ans, char *text, int ret)
+{
+	(*ans).text = text;
+	(*ans).returnCode = ret;
+}
+// Bytes left in a seekable input, 0 when unknown
+size_t remainingBytes(FILE *f)
+{
+	long here = ftell(f);
+	if (here < 0 || fseek(f, 0, SEEK_END) != 0)
+	{
+		return 0;
+	}
+	long end = ftell(f);
+	fseek(f, here, SEEK_SET);
+	return end > here ? (size_t)(end - here) : 0;
+}
+// Lists an IDAT chunk of an input in memory, the list grows in the arena
+int addChunk(struct image *buf, size_t offset, size_t size)
+{
+	if ((*buf).chunkCount == (*buf).chunkCapacity)
+	{
+		size_t capacity = (*buf).chunkCapacity == 0 ? 64 : (*buf).chunkCapacity * 2;
+		size_t (*chunks)[2] = arenaAlloc(threadArena, capacity * sizeof((*buf).chunks[0]));
+		if (chunks == NULL)
+		{
+			return -1;
+		}
+		if ((*buf).chunkCount > 0)
+		{
+			memcpy(chunks, (*buf).chunks, (*buf).chunkCount * sizeof((*buf).chunks[0]));
+		}
+		(*buf).chunks = chunks;
+		(*buf).chunkCapacity = capacity;
+	}
+	(*buf).chunks[(*buf).chunkCount][0] = offset;
+	(*buf).chunks[(*buf).chunkCount][1] = size;
+	(*buf).chunkCount++;
+	return 0;
+}
+struct pair parsePNG(FILE *f, struct image *buf)
+{
+	size_t ret;
+	struct pair ans;
+	int plte = 1;
+	int idat = 1;
+	unsigned char tmp[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	// Chunk lengths are checked against what is left of a seekable input before anything is allocated for them
+	size_t left = remainingBytes(f);
+	while (1)
+	{
+		ans.returnCode = SUCCESS;
+		ret = fread(tmp, 1, 8, f);
+		if (ret != 8)
+		{
+			makeError(&ans, "Reached end of the file\n", ERROR_DATA_INVALID);
+			return ans;
+		}
+		size_t size = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			size = size << 8 | tmp[i];
+		}
+		if (size > 0x7FFFFFFF || (left > 0 && size + 12 > left))
+		{
+			makeError(&ans, "Chunk length exceeds the file\n", ERROR_DATA_INVALID);
+			return ans;
+		}
+		left -= left > 0 ? size + 12 : 0;
+		char name[8] = { tmp[4] & 0xFF, tmp[5] & 0xFF, tmp[6] & 0xFF, tmp[7] & 0xFF };
+		if (idat == 2 && strcmp(name, "IDAT") != 0)
+		{
+			idat = 0;
+		}
+		if (strcmp(name, "IDAT") == 0)
+		{
+			plte = 0;
+			if (idat == 0)
+			{
+				makeError(&ans, "IDAT chunks must be in consecutive order\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+			idat = 2;
+			if ((*buf).source != NULL || (*buf).file != NULL)
+			{
+				long offset = ftell(f);
+				if (offset < 0 || fseek(f, size, SEEK_CUR) != 0)
+				{
+					makeError(&ans, "Wrong size of data in idat chunk\n", ERROR_DATA_INVALID);
+					return ans;
+				}
+				if ((*buf).file != NULL && (*buf).idatOffset == 0)
+				{
+					(*buf).idatOffset = offset - 8;
+				}
+				if ((*buf).source != NULL && size > 0 && addChunk(buf, offset, size) != 0)
+				{
+					makeError(&ans, "Not enough memory for chunk list\n", ERROR_OUT_OF_MEMORY);
+					return ans;
+				}
+				(*buf).size += size;
+			}
+			else
+			{
+				if ((*buf).size + size > (*buf).capacity)
+				{
+					// Grow geometrically, a pooled buffer usually fits the next image without reallocation
+					size_t capacity = (*buf).size + size;
+					capacity = (*buf).capacity * 2 > capacity ? (*buf).capacity * 2 : capacity;
+					if ((*buf).limit > 0 && (*buf).size + size > (*buf).limit)
+					{
+						makeError(&ans, "Compressed data exceeds the memory budget\n", ERROR_OUT_OF_MEMORY);
+						return ans;
+					}
+					capacity = (*buf).limit > 0 && capacity > (*buf).limit ? (*buf).limit : capacity;
+					unsigned char *t = reallocate((*buf).data, capacity * sizeof(char));
+					if (t == NULL)
+					{
+						makeError(&ans, "Not enough memory for new chunk\n", ERROR_OUT_OF_MEMORY);
+						return ans;
+					}
+					(*buf).data = t;
+					(*buf).capacity = capacity;
+				}
+				ret = fread((*buf).data + (*buf).size, 1, size, f);
+				if (ret != size)
+				{
+					makeError(&ans, "Wrong size of data in idat chunk\n", ERROR_DATA_INVALID);
+					return ans;
+				}
+				(*buf).size += size;
+			}
+		}
+		else if (strcmp(name, "IEND") == 0)
+		{
+			ret = fread(tmp, 1, (*buf).concatenated ? 4 : 5, f);
+			if (ret != 4)
+			{
+				makeError(&ans, "Wrong chunk after IEND\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+			break;
+		}
+		else if (strcmp(name, "PLTE") == 0)
+		{
+			if ((*buf).type == 0)
+			{
+				makeError(&ans, "Color type 0 don't expect plte chunk\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+			if (plte == 0)
+			{
+				makeError(&ans, "Pallet chunk in wrong place\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+			plte = 0;
+			if (size == 0 || size % 3 != 0 || size > 256 * 3)
+			{
+				makeError(&ans, "Wrong plte chunk size\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+			(*buf).plteData = arenaAlloc(threadArena, size);
+			(*buf).plteSize = size / 3;
+			if (!(*buf).plteData)
+			{
+				makeError(&ans, "Cannot alloc memory for pallet\n", ERROR_OUT_OF_MEMORY);
+				return ans;
+			}
+			ret = fread((*buf).plteData, 1, size, f);
+			if (ret != size)
+			{
+				makeError(&ans, "Wrong plte chunk size\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+		}
+		else if (size == 0)
+		{
+			makeError(&ans, "Expected IEND chunk, found unsupported\n", ERROR_DATA_INVALID);
+			return ans;
+		}
+		else
+		{
+			unsigned char *temp = arenaAlloc(threadArena, sizeof(unsigned char) * size);
+			if (!temp)
+			{
+				makeError(&ans, "Not enough memory for chunk data\n", ERROR_OUT_OF_MEMORY);
+				return ans;
+			}
+			ret = fread(temp, 1, size, f);
+			if (ret != size)
+			{
+				makeError(&ans, "Wrong chunk size\n", ERROR_DATA_INVALID);
+				return ans;
+			}
+		}
+		ret = fread(tmp, 1, 4, f);
+		if (ret != 4)
+		{
+			makeError(&ans, "Wrong chunk hashcode size\n", ERROR_DATA_INVALID);
+			return ans;
+		}
+	}
+	return ans;
+}
+int isGrayScale(unsigned char r, unsigned char g, unsigned char b)
+{
+	return r == g && g == b;
+}
+// Branch-free so the compiler vectorizes it, a non-zero result means the row has a colored pixel
+unsigned char rowChroma(const unsigned char *rgb, int width)
+{
+	unsigned char diff = 0;
+	for (size_t k = 0; k < (size_t)width; k++)
+	{
+		diff |= (rgb[3 * k] ^ rgb[3 * k + 1]) | (rgb[3 * k + 1] ^ rgb[3 * k + 2]);
+	}
+	return diff;
+}
+// Keeps one channel of achromatic RGB pixels, in place
+void collapseGray(unsigned char *out2, size_t pixels)
+{
+	for (size_t i = 0; i < pixels; i++)
+	{
+		out2[i] = out2[i * 3];
+	}
+}
+
+// Returns -6 when the output could not be written, like writePallet and streamRaw
+int writeToFile(FILE *f, unsigned char *out2, struct image buf, int asP5, size_t size, int type, int par[])
+{
+	size_t written;
+	if (asP5 == 0)
+	{
+		fprintf(f, "P6\n");
+		fprintf(f, "%i %i\n", par[0], par[1]);
+		fprintf(f, "255\n");
+		written = fwrite(out2, 1, size * 3, f) / 3;
+	}
+	else
+	{
+		fprintf(f, "P5\n");
+		fprintf(f, "%i %i\n", par[0], par[1]);
+		fprintf(f, "255\n");
+		written = fwrite(out2, 1, size, f);
+	}
+	return written == size && !ferror(f) ? 0 : -6;
+}
+// Row kernels for every (filter, bytes per pixel) pair. They read bpp bytes left of row and prev, so the caller
+// either pads the rows or reconstructs the first pixel itself. The pixel loop has a constant bound and unrolls
+typedef void (*rowKernel)(unsigned char *row, const unsigned char *prev, size_t rowBytes);
+void unfilterNone(unsigned char *row, const unsigned char *prev, size_t rowBytes) {}
+#define ROW_KERNELS(bpp)                                                                                               \
+	void unfilterSub##bpp(unsigned char *row, const unsigned char *prev, size_t rowBytes)                              \
+	{                                                                                                                  \
+		for (size_t k = 0; k < rowBytes; k += bpp)                                                                     \
+		{                                                                                                              \
+			for (int i = 0; i < bpp; i++)                                                                              \
+			{                                                                                                          \
+				row[k + i] += row[(ptrdiff_t)(k + i) - bpp];                                                           \
+			}                                                                                                          \
+		}                                                                                                              \
+	}                                                                                                                  \
+	void unfilterUp##bpp(unsigned char *row, const unsigned char *prev, size_t rowBytes)                               \
+	{                                                                                                                  \
+		for (size_t k = 0; k < rowBytes; k += bpp)                                                                     \
+		{                                                                                                              \
+			for (int i = 0; i < bpp; i++)                                                                              \
+			{                                                                                                          \
+				row[k + i] += prev[k + i];                                                                             \
+			}                                                                                                          \
+		}                                                                                                              \
+	}                                                                                                                  \
+	void unfilterAverage##bpp(unsigned char *row, const unsigned char *prev, size_t rowBytes)                          \
+	{                                                                                                                  \
+		for (size_t k = 0; k < rowBytes; k += bpp)                                                                     \
+		{                                                                                                              \
+			for (int i = 0; i < bpp; i++)                                                                              \
+			{                                                                                                          \
+				row[k + i] += (row[(ptrdiff_t)(k + i) - bpp] + prev[k + i]) / 2;                                       \
+			}                                                                                                          \
+		}                                                                                                              \
+	}                                                                                                                  \
+	void unfilterPaeth##bpp(unsigned char *row, const unsigned char *prev, size_t rowBytes)                            \
+	{                                                                                                                  \
+		for (size_t k = 0; k < rowBytes; k += bpp)                                                                     \
+		{                                                                                                              \
+			for (int i = 0; i < bpp; i++)                                                                              \
+			{                                                                                                          \
+				int a = row[(ptrdiff_t)(k + i) - bpp];                                                                 \
+				int b = prev[k + i];                                                                                   \
+				int c = prev[(ptrdiff_t)(k + i) - bpp];                                                                \
+				int ma = abs(b - c);                                                                                   \
+				int mb = abs(a - c);                                                                                   \
+				int mc = abs(a + b - 2 * c);                                                                           \
+				row[k + i] += (ma <= mb && ma <= mc) ? a : (mb <= mc ? b : c);                                         \
+			}                                                                                                          \
+		}                                                                                                              \
+	}
+ROW_KERNELS(1)
+ROW_KERNELS(3)
+// Indexed by bytes per pixel and filter type
+const rowKernel rowKernels[4][5] = {
+	[1] = { unfilterNone, unfilterSub1, unfilterUp1, unfilterAverage1, unfilterPaeth1 },
+	[3] = { unfilterNone, unfilterSub3, unfilterUp3, unfilterAverage3, unfilterPaeth3 },
+};
+// Reconstructs one row in place, prev is the previous reconstructed row or NULL for the first one
+int unfilterLine(unsigned char filter, unsigned char *row, const unsigned char *prev, size_t rowBytes, int type)
+{
+	if (filter > 4)
+	{
+		return -1;
+	}
+	if (prev == NULL)
+	{
+		// Above the first row everything is zero: Up does nothing and Paeth is Sub
+		for (size_t k = type; k < rowBytes && (filter == 1 || filter >= 3); k++)
+		{
+			row[k] += filter == 3 ? row[k - type] / 2 : row[k - type];
+		}
+		return 0;
+	}
+	// The first pixel has no left neighbour, so Paeth picks the upper one
+	for (int k = 0; k < type && filter > 1; k++)
+	{
+		row[k] += filter == 3 ? prev[k] / 2 : prev[k];
+	}
+	rowKernels[type][filter](row + type, prev + type, rowBytes - type);
+	return 0;
+}
+int unfilterRow(unsigned char *out1, int j, int type, int par[])
+{
+	size_t stride = (size_t)par[0] * type + 1;
+	unsigned char *prev = j == 0 ? NULL : out1 + (j - 1) * stride + 1;
+	return unfilterLine(out1[j * stride], out1 + j * stride + 1, prev, stride - 1, type);
+}
+// Padded row layout of out1 and of the streaming rows: every row starts on a ROW_ALIGN boundary behind a pad of
+// ROW_ALIGN zero bytes, except the first one which holds the filter type, and a zero row -1 precedes row 0. The
+// predictors then read zeros left of the first pixel and above the first row instead of testing for the edges.
+// Narrow rows would be mostly pad, so when the padded stride is more than twice the packed one the rows stay packed
+// at the same addresses, each behind its filter type, and are unfiltered with the edge tests
+#define ROW_ALIGN 64
+size_t paddedStride(int par[], int type)
+{
+	size_t packed = (size_t)par[0] * type + 1;
+	size_t padded = ROW_ALIGN + ((size_t)par[0] * type + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+	return padded > 2 * packed ? packed : padded;
+}
+// Bytes to reserve for the rows, including the slack needed to align the first row and the pad before it
+size_t paddedSize(int par[], int type)
+{
+	return ((size_t)par[1] + 1) * paddedStride(par, type) + 2 * ROW_ALIGN;
+}
+// Where the filter type of a row is kept, padded rows are always longer than packed ones
+size_t paddedFilter(size_t stride, size_t rowBytes)
+{
+	return stride == rowBytes + 1 ? 1 : ROW_ALIGN;
+}
+unsigned char *paddedBase(unsigned char *out1)
+{
+	return out1 + (ROW_ALIGN - (uintptr_t)out1 % ROW_ALIGN) % ROW_ALIGN;
+}
+// Pixels of row j, from -1 to par[1] - 1, the filter type is at row[-paddedFilter()]
+unsigned char *paddedRow(unsigned char *base, size_t stride, int j)
+{
+	return base + (size_t)(j + 1) * stride + ROW_ALIGN;
+}
+// Reconstructs a row in place below the row before it
+int unfilterPadded(unsigned char *row, size_t stride, size_t rowBytes, int type)
+{
+	size_t pad = paddedFilter(stride, rowBytes);
+	unsigned char filter = row[-pad];
+	if (pad == 1)
+	{
+		return unfilterLine(filter, row, row - stride, rowBytes, type);
+	}
+	if (filter > 4)
+	{
+		return -1;
+	}
+	rowKernels[type][filter](row, row - stride, rowBytes);
+	return 0;
+}
+// Rows inflated by one call when the layout is padded, a decompressor call per row is slower than the copy
+#define INFLATE_BATCH ((size_t)64 << 10)
+// Inflates the whole image into the rows of base. Packed rows are contiguous and inflated in one call, padded ones a
+// batch at a time into a scratch buffer and moved into place
+int inflatePadded(struct inflater *infl, struct image buf, unsigned char *base, int par[], int type)
+{
+	size_t rowBytes = (size_t)par[0] * type;
+	size_t stride = paddedStride(par, type);
+	size_t pad = paddedFilter(stride, rowBytes);
+	memset(base, 0, stride + ROW_ALIGN);
+	if (pad == 1)
+	{
+		return inf(infl, &buf, paddedRow(base, stride, 0) - 1, stride * par[1], PARTIAL_INFLATE);
+	}
+	size_t batch = INFLATE_BATCH / (rowBytes + 1);
+	batch = batch == 0 ? 1 : batch;
+	unsigned char *scratch = arenaAlloc(threadArena, batch * (rowBytes + 1));
+	if (scratch == NULL)
+	{
+		return ERROR_OUT_OF_MEMORY;
+	}
+	int ret = inflaterInit(infl, &buf, (rowBytes + 1) * par[1]);
+	for (int j = 0; j < par[1] && ret == SUCCESS; j += batch)
+	{
+		size_t rows = (size_t)(par[1] - j) < batch ? (size_t)(par[1] - j) : batch;
+		ret = inflaterRead(infl, scratch, rows * (rowBytes + 1));
+		for (size_t k = 0; k < rows && ret == SUCCESS; k++)
+		{
+			unsigned char *row = paddedRow(base, stride, j + k);
+			memset(row - pad, 0, pad);
+			row[-pad] = scratch[k * (rowBytes + 1)];
+			memcpy(row, scratch + k * (rowBytes + 1) + 1, rowBytes);
+		}
+	}
+	inflaterEnd(infl);
+	return ret;
+}
+// Checks the indices of one row and marks the palette entries they use
+int markPallet(const unsigned char *row, int width, struct image buf, unsigned char used[])
+{
+	for (int k = 0; k < width; k++)
+	{
+		if (row[k] >= buf.plteSize)
+		{
+			return -2;
+		}
+		used[row[k]] = 1;
+	}
+	return 0;
+}
+int palletIsGray(struct image buf, const unsigned char used[])
+{
+	for (size_t i = 0; i < buf.plteSize; i++)
+	{
+		if (used[i] && !isGrayScale(buf.plteData[i * 3], buf.plteData[i * 3 + 1], buf.plteData[i * 3 + 2]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+// Expands rows of palette indices (stride bytes apart) into gray or RGB pixels
+void expandPallet(unsigned char *out2,
+				  const unsigned char *idx,
+				  size_t stride,
+				  int rows,
+				  int width,
+				  struct image buf,
+				  int asP5)
+{
+	for (int j = 0; j < rows; j++)
+	{
+		const unsigned char *row = idx + j * stride;
+		for (int k = 0; k < width; k++)
+		{
+			if (asP5)
+			{
+				*out2++ = buf.plteData[row[k] * 3];
+			}
+			else
+			{
+				memcpy(out2, buf.plteData + row[k] * 3, 3);
+				out2 += 3;
+			}
+		}
+	}
+}
+// Unfilters all indices first, so P5 is decided before any pixel is expanded
+int palletRaw(size_t size, int type, int par[], unsigned char *out2, unsigned char *out1, struct image buf, int *asP5)
+{
+	unsigned char used[256] = { 0 };
+	size_t stride = paddedStride(par, type);
+	struct mark t = stageStart();
+	for (int j = 0; j < par[1]; j++)
+	{
+		unsigned char *row = paddedRow(out1, stride, j);
+		if (unfilterPadded(row, stride, (size_t)par[0] * type, type) != 0)
+		{
+			return -1;
+		}
+		if (markPallet(row, par[0], buf, used) != 0)
+		{
+			return -2;
+		}
+	}
+	stageEnd(STAGE_UNFILTER, t, size + par[1], size);
+	t = stageStart();
+	*asP5 = palletIsGray(buf, used);
+	expandPallet(out2, paddedRow(out1, stride, 0), stride, par[1], par[0], buf, *asP5);
+	stageEnd(STAGE_EXPAND, t, size, size * (*asP5 ? 1 : 3));
+	return 0;
+}
+// Palette decode straight to a file: each row is unfiltered, looked up and written while it is still in cache. Only
+// when the palette has colours do the used entries decide P5, then the indices are unfiltered in a first pass
+int writePallet(FILE *f, int par[], unsigned char *out1, struct image buf, int *asP5)
+{
+	unsigned char used[256];
+	memset(used, 1, sizeof(used));
+	int fused = palletIsGray(buf, used);
+	size_t width = par[0];
+	size_t stride = paddedStride(par, 1);
+	unsigned char *out = arenaAlloc(threadArena, width * 3);
+	if (out == NULL)
+	{
+		return -3;
+	}
+	*asP5 = fused;
+	if (!fused)
+	{
+		memset(used, 0, sizeof(used));
+		struct mark t = stageStart();
+		for (int j = 0; j < par[1]; j++)
+		{
+			unsigned char *row = paddedRow(out1, stride, j);
+			if (unfilterPadded(row, stride, width, 1) != 0)
+			{
+				return -1;
+			}
+			if (markPallet(row, par[0], buf, used) != 0)
+			{
+				return -2;
+			}
+		}
+		stageEnd(STAGE_UNFILTER, t, (width + 1) * par[1], width * par[1]);
+		*asP5 = palletIsGray(buf, used);
+	}
+	size_t rowOut = width * (*asP5 ? 1 : 3);
+	fprintf(f, "P%c\n%i %i\n255\n", *asP5 ? '5' : '6', par[0], par[1]);
+	for (int j = 0; j < par[1]; j++)
+	{
+		unsigned char *row = paddedRow(out1, stride, j);
+		struct mark t = stageStart();
+		if (fused && unfilterPadded(row, stride, width, 1) != 0)
+		{
+			return -1;
+		}
+		if (fused && markPallet(row, par[0], buf, used) != 0)
+		{
+			return -2;
+		}
+		stageEnd(STAGE_UNFILTER, t, fused ? width + 1 : 0, fused ? width : 0);
+		t = stageStart();
+		expandPallet(out, row, stride, 1, par[0], buf, *asP5);
+		stageEnd(STAGE_EXPAND, t, width, rowOut);
+		t = stageStart();
+		if (fwrite(out, 1, rowOut, f) != rowOut)
+		{
+			return -6;
+		}
+		stageEnd(STAGE_WRITE, t, rowOut, rowOut);
+	}
+	return 0;
+}
+// With expand unset palette indices are left in out2 for writeBands to expand
+int convertRaw(size_t size,
+			   int type,
+			   int par[],
+			   unsigned char *out2,
+			   unsigned char *out1,
+			   struct image buf,
+			   int *asP5,
+			   int expand)
+{
+	if (buf.type == 3 && expand)
+	{
+		return palletRaw(size, type, par, out2, out1, buf, asP5);
+	}
+	unsigned char used[256] = { 0 };
+	size_t rowBytes = (size_t)par[0] * type;
+	size_t stride = paddedStride(par, type);
+	struct mark t = stageStart();
+	for (int j = 0; j < par[1]; j++)
+	{
+		unsigned char *row = paddedRow(out1, stride, j);
+		if (unfilterPadded(row, stride, rowBytes, type) != 0)
+		{
+			return -1;
+		}
+		if (buf.type == 3 && markPallet(row, par[0], buf, used) != 0)
+		{
+			return -2;
+		}
+		if (*asP5 == 1 && buf.type == 2 && rowChroma(row, par[0]) != 0)
+		{
+			*asP5 = 0;
+		}
+		memcpy(out2 + j * rowBytes, row, rowBytes);
+	}
+	stageEnd(STAGE_UNFILTER, t, size * type + par[1], size * type);
+	if (buf.type == 3)
+	{
+		*asP5 = palletIsGray(buf, used);
+	}
+	else if (*asP5 == 1 && buf.type == 2)
+	{
+		t = stageStart();
+		collapseGray(out2, size);
+		stageEnd(STAGE_EXPAND, t, size * type, size);
+	}
+	return 0;
+}
+void scaledSize(int par[], int scale, int outPar[])
+{
+	outPar[0] = (par[0] + scale - 1) / scale;
+	outPar[1] = (par[1] + scale - 1) / scale;
+}
+// Box-filters the image down by scale while inflating it two rows at a time, the full-resolution image is never held.
+// Sums are 64-bit, a box of up to 65536 x 65536 pixels would overflow 32 bits
+int scaleRaw(int type, int par[], unsigned char *out2, struct image buf, int *asP5, int scale, struct inflater *infl)
+{
+	int outPar[2];
+	scaledSize(par, scale, outPar);
+	int channels = (buf.type == 0) ? 1 : 3;
+	size_t rowBytes = (size_t)par[0] * type;
+	uint64_t *acc = arenaAlloc(threadArena, (size_t)outPar[0] * channels * sizeof(uint64_t));
+	unsigned char *lines = arenaAlloc(threadArena, 2 * (rowBytes + 1));
+	if (!acc || !lines)
+	{
+		return -3;
+	}
+	memset(acc, 0, (size_t)outPar[0] * channels * sizeof(uint64_t));
+	int ret = inflaterInit(infl, &buf, (rowBytes + 1) * par[1]);
+	if (ret != SUCCESS)
+	{
+		return ret == ERROR_OUT_OF_MEMORY ? -5 : -4;
+	}
+	size_t x = 0;
+	for (int j = 0; j < par[1] && ret == 0; j++)
+	{
+		unsigned char *cur = lines + (j % 2) * (rowBytes + 1);
+		unsigned char *prev = lines + (1 - j % 2) * (rowBytes + 1);
+		struct mark t = stageStart();
+		ret = inflaterRead(infl, cur, rowBytes + 1);
+		stageEnd(STAGE_INFLATE, t, 0, rowBytes + 1);
+		if (ret != SUCCESS)
+		{
+			ret = ret == ERROR_OUT_OF_MEMORY ? -5 : -4;
+			break;
+		}
+		t = stageStart();
+		if (unfilterLine(cur[0], cur + 1, j == 0 ? NULL : prev + 1, rowBytes, type) != 0)
+		{
+			ret = -1;
+			break;
+		}
+		unsigned char *row = cur + 1;
+		for (int k = 0; k < par[0] && ret == 0; k++)
+		{
+			uint64_t *a = acc + (k / scale) * channels;
+			if (buf.type == 3)
+			{
+				if (row[k] >= buf.plteSize)
+				{
+					ret = -2;
+					break;
+				}
+				for (int l = 0; l < 3; l++)
+				{
+					a[l] += buf.plteData[row[k] * 3 + l];
+				}
+			}
+			else
+			{
+				for (int l = 0; l < channels; l++)
+				{
+					a[l] += row[(size_t)k * channels + l];
+				}
+			}
+		}
+		stageEnd(STAGE_UNFILTER, t, rowBytes + 1, rowBytes);
+		if (ret != 0 || ((j + 1) % scale != 0 && j != par[1] - 1))
+		{
+			continue;
+		}
+		uint64_t rows = j % scale + 1;
+		for (int k = 0; k < outPar[0]; k++)
+		{
+			uint64_t count = rows * (uint64_t)((k == outPar[0] - 1) ? par[0] - k * scale : scale);
+			for (int l = 0; l < channels; l++)
+			{
+				out2[x + l] = (acc[(size_t)k * channels + l] + count / 2) / count;
+			}
+			if (channels == 3 && !isGrayScale(out2[x], out2[x + 1], out2[x + 2]))
+			{
+				*asP5 = 0;
+			}
+			x += channels;
+		}
+		memset(acc, 0, (size_t)outPar[0] * channels * sizeof(uint64_t));
+	}
+	inflaterEnd(infl);
+	if (ret == 0 && *asP5 == 1 && buf.type != 0)
+	{
+		collapseGray(out2, (size_t)outPar[0] * outPar[1]);
+	}
+	return ret;
+}
+static const int adam7[7][4] = {
+	{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 },
+};
+void passSize(int par[], int pass, int passPar[])
+{
+	passPar[0] = par[0] > adam7[pass][0] ? (par[0] - adam7[pass][0] + adam7[pass][2] - 1) / adam7[pass][2] : 0;
+	passPar[1] = par[1] > adam7[pass][1] ? (par[1] - adam7[pass][1] + adam7[pass][3] - 1) / adam7[pass][3] : 0;
+}
+// Bytes of inflated data covering Adam7 passes 1..passes
+size_t previewInput(int par[], int type, int passes)
+{
+	size_t total = 0;
+	for (int p = 0; p < passes; p++)
+	{
+		int passPar[2];
+		passSize(par, p, passPar);
+		if (passPar[0] != 0 && passPar[1] != 0)
+		{
+			total += (size_t)passPar[1] * ((size_t)passPar[0] * type + 1);
+		}
+	}
+	return total;
+}
+// After pass N the known pixels form a grid with the step of pass N + 1 (full image after pass 7)
+void previewSize(int par[], int passes, int outPar[])
+{
+	int dx = passes == 7 ? 1 : adam7[passes][2];
+	int dy = passes == 7 ? 1 : adam7[passes][3];
+	outPar[0] = (par[0] + dx - 1) / dx;
+	outPar[1] = (par[1] + dy - 1) / dy;
+}
+int previewRaw(int type, int par[], unsigned char *out2, unsigned char *out1, struct image buf, int *asP5, int passes)
+{
+	int outPar[2];
+	previewSize(par, passes, outPar);
+	int dx = (par[0] + outPar[0] - 1) / outPar[0];
+	int dy = (par[1] + outPar[1] - 1) / outPar[1];
+	int channels = (buf.type == 0) ? 1 : 3;
+	for (int p = 0; p < passes; p++)
+	{
+		int passPar[2];
+		passSize(par, p, passPar);
+		if (passPar[0] == 0 || passPar[1] == 0)
+		{
+			continue;
+		}
+		size_t stride = (size_t)passPar[0] * type + 1;
+		for (int j = 0; j < passPar[1]; j++)
+		{
+			if (unfilterRow(out1, j, type, passPar) != 0)
+			{
+				return -1;
+			}
+			unsigned char *row = out1 + j * stride + 1;
+			size_t y = ((size_t)adam7[p][1] + (size_t)j * adam7[p][3]) / dy;
+			for (int k = 0; k < passPar[0]; k++)
+			{
+				size_t x = (((size_t)adam7[p][0] + (size_t)k * adam7[p][2]) / dx + y * outPar[0]) * channels;
+				if (buf.type == 3)
+				{
+					if (row[k] >= buf.plteSize)
+					{
+						return -2;
+					}
+					memcpy(out2 + x, buf.plteData + row[k] * 3, 3);
+					if (!isGrayScale(out2[x], out2[x + 1], out2[x + 2]))
+					{
+						*asP5 = 0;
+					}
+				}
+				else
+				{
+					memcpy(out2 + x, row + (size_t)k * channels, channels);
+					if (channels == 3 && !isGrayScale(out2[x], out2[x + 1], out2[x + 2]))
+					{
+						*asP5 = 0;
+					}
+				}
+			}
+		}
+		out1 += (size_t)passPar[1] * stride;
+	}
+	if (*asP5 == 1 && buf.type != 0)
+	{
+		collapseGray(out2, (size_t)outPar[0] * outPar[1]);
+	}
+	return 0;
+}
+#if defined(_WIN32)
+typedef HANDLE thread_t;
+struct threadStart
+{
+	void *(*fn)(void *);
+	void *arg;
+};
+DWORD WINAPI threadTrampoline(LPVOID p)
+{
+	struct threadStart start = *(struct threadStart *)p;
+	free(p);
+	start.fn(start.arg);
+	return 0;
+}
+#else
+typedef pthread_t thread_t;
+#endif
+int threadCreate(thread_t *t, void *(*fn)(void *), void *arg)
+{
+#if defined(_WIN32)
+	struct threadStart *start = malloc(sizeof(struct threadStart));
+	if (start == NULL)
+	{
+		return -1;
+	}
+	(*start).fn = fn;
+	(*start).arg = arg;
+	*t = CreateThread(NULL, 0, threadTrampoline, start, 0, NULL);
+	if (*t == NULL)
+	{
+		free(start);
+		return -1;
+	}
+	return 0;
+#else
+	return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+#endif
+}
+void threadJoin(thread_t t)
+{
+#if defined(_WIN32)
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+#else
+	pthread_join(t, NULL);
+#endif
+}
+void threadYield(void)
+{
+#if defined(_WIN32)
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+// Blocking wait for a condition that other threads announce with parkNotify. A waiter takes a ticket, checks its
+// condition once more and only then sleeps until the next notification, so one sent in between is not lost.
+// Notifying costs two atomic operations while nobody sleeps
+struct parking
+{
+#if defined(_WIN32)
+	SRWLOCK lock;
+	CONDITION_VARIABLE wake;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+#endif
+	atomic_uint sequence;
+	atomic_int sleepers;
+};
+void parkInit(struct parking *p)
+{
+#if defined(_WIN32)
+	InitializeSRWLock(&(*p).lock);
+	InitializeConditionVariable(&(*p).wake);
+#else
+	pthread_mutex_init(&(*p).lock, NULL);
+	pthread_cond_init(&(*p).wake, NULL);
+#endif
+	atomic_init(&(*p).sequence, 0);
+	atomic_init(&(*p).sleepers, 0);
+}
+void parkFree(struct parking *p)
+{
+#if !defined(_WIN32)
+	pthread_mutex_destroy(&(*p).lock);
+	pthread_cond_destroy(&(*p).wake);
+#endif
+}
+unsigned int parkTicket(struct parking *p)
+{
+	atomic_fetch_add(&(*p).sleepers, 1);
+	return atomic_load(&(*p).sequence);
+}
+// The condition turned out to hold after all
+void parkCancel(struct parking *p)
+{
+	atomic_fetch_sub(&(*p).sleepers, 1);
+}
+// Sleeps unless a notification came after the ticket was taken
+void parkWait(struct parking *p, unsigned int ticket)
+{
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&(*p).lock);
+	while (atomic_load(&(*p).sequence) == ticket)
+	{
+		SleepConditionVariableSRW(&(*p).wake, &(*p).lock, INFINITE, 0);
+	}
+	ReleaseSRWLockExclusive(&(*p).lock);
+#else
+	pthread_mutex_lock(&(*p).lock);
+	while (atomic_load(&(*p).sequence) == ticket)
+	{
+		pthread_cond_wait(&(*p).wake, &(*p).lock);
+	}
+	pthread_mutex_unlock(&(*p).lock);
+#endif
+	atomic_fetch_sub(&(*p).sleepers, 1);
+}
+void parkNotify(struct parking *p)
+{
+	atomic_fetch_add(&(*p).sequence, 1);
+	if (atomic_load(&(*p).sleepers) == 0)
+	{
+		return;
+	}
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&(*p).lock);
+	WakeAllConditionVariable(&(*p).wake);
+	ReleaseSRWLockExclusive(&(*p).lock);
+#else
+	pthread_mutex_lock(&(*p).lock);
+	pthread_cond_broadcast(&(*p).wake);
+	pthread_mutex_unlock(&(*p).lock);
+#endif
+}
+// Work-stealing pool of the batch workers. Whole files are handed out by the batch itself, the row bands of large
+// images are pushed as tasks that idle workers steal, so both levels share the same --threads workers
+#define POOL_TASKS 256
+#define POOL_BAND_BYTES ((size_t)1 << 22)
+struct task
+{
+	void *(*fn)(void *);
+	void *arg;
+	atomic_int *pending;
+};
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves take at the top
+struct taskDeque
+{
+	atomic_llong top;
+	atomic_llong bottom;
+	struct task tasks[POOL_TASKS];
+};
+static struct taskDeque *poolDeques;
+static int poolWorkers;
+// Idle pool workers sleep here: a task pushed, a file finished and an input read ahead wake them
+static struct parking poolParking;
+// Index of the pool worker running on this thread, -1 outside the pool
+static _Thread_local int poolSelf = -1;
+int taskPush(struct taskDeque *d, struct task t)
+{
+	long long b = atomic_load(&(*d).bottom);
+	if (b - atomic_load(&(*d).top) >= POOL_TASKS)
+	{
+		return -1;
+	}
+	(*d).tasks[b % POOL_TASKS] = t;
+	atomic_store(&(*d).bottom, b + 1);
+	return 0;
+}
+int taskTake(struct taskDeque *d, struct task *t)
+{
+	long long b = atomic_load(&(*d).bottom) - 1;
+	atomic_store(&(*d).bottom, b);
+	long long top = atomic_load(&(*d).top);
+	if (top > b)
+	{
+		atomic_store(&(*d).bottom, b + 1);
+		return -1;
+	}
+	*t = (*d).tasks[b % POOL_TASKS];
+	if (top < b)
+	{
+		return 0;
+	}
+	// The last task, a thief may be taking it right now
+	int won = atomic_compare_exchange_strong(&(*d).top, &top, top + 1);
+	atomic_store(&(*d).bottom, b + 1);
+	return won ? 0 : -1;
+}
+int taskSteal(struct taskDeque *d, struct task *t)
+{
+	long long top = atomic_load(&(*d).top);
+	if (top >= atomic_load(&(*d).bottom))
+	{
+		return -1;
+	}
+	*t = (*d).tasks[top % POOL_TASKS];
+	return atomic_compare_exchange_strong(&(*d).top, &top, top + 1) ? 0 : -1;
+}
+// Runs one queued task, the worker's own ones first, returns -1 when there was none
+int poolHelp(void)
+{
+	struct task t;
+	int found = taskTake(&poolDeques[poolSelf], &t) == 0;
+	for (int v = 1; !found && v < poolWorkers; v++)
+	{
+		found = taskSteal(&poolDeques[(poolSelf + v) % poolWorkers], &t) == 0;
+	}
+	if (!found)
+	{
+		return -1;
+	}
+	t.fn(t.arg);
+	if (atomic_fetch_sub(t.pending, 1) == 1)
+	{
+		parkNotify(&poolParking);
+	}
+	return 0;
+}
+// Calls fn on count arguments of size bytes each and waits for all of them. Inside the pool the calls are tasks
+// and the caller helps with queued ones while waiting, elsewhere each call gets its own thread
+void forkJoin(void *(*fn)(void *), void *args, size_t size, int count)
+{
+	unsigned char *arg = args;
+	if (poolSelf < 0)
+	{
+		thread_t *ids = calloc(count, sizeof(thread_t));
+		int started = 0;
+		for (int i = 0; i < count - 1; i++)
+		{
+			if (ids == NULL || threadCreate(&ids[started], fn, arg + i * size) != 0)
+			{
+				fn(arg + i * size);
+				continue;
+			}
+			started++;
+		}
+		fn(arg + (count - 1) * size);
+		for (int i = 0; i < started; i++)
+		{
+			threadJoin(ids[i]);
+		}
+		free(ids);
+		return;
+	}
+	atomic_int pending;
+	atomic_init(&pending, 0);
+	for (int i = 0; i < count - 1; i++)
+	{
+		struct task t = { .fn = fn, .arg = arg + i * size, .pending = &pending };
+		atomic_fetch_add(&pending, 1);
+		if (taskPush(&poolDeques[poolSelf], t) != 0)
+		{
+			atomic_fetch_sub(&pending, 1);
+			fn(t.arg);
+		}
+	}
+	parkNotify(&poolParking);
+	fn(arg + (count - 1) * size);
+	while (atomic_load(&pending) > 0)
+	{
+		if (poolHelp() == 0)
+		{
+			continue;
+		}
+		// The rest run on other workers: sleep until the last of them finishes or another task is pushed
+		unsigned int ticket = parkTicket(&poolParking);
+		if (atomic_load(&pending) > 0 && poolHelp() != 0)
+		{
+			parkWait(&poolParking, ticket);
+		}
+		else
+		{
+			parkCancel(&poolParking);
+		}
+	}
+}
+// Lock-free ring of fixed-size rows that every row passes through a fixed sequence of stages, each on its own
+// thread. A stage works on the slot at its own position once the stage before it has moved past that slot, the
+// first one once the last one has freed a slot. The slot behind the last stage is never refilled, so a stage may
+// still read the row before its own
+#define RING_ROWS 16
+#define RING_STAGES 3
+// Yields before a stage that has nothing to do goes to sleep
+#define RING_SPINS 16
+struct ring
+{
+	unsigned char *slots;
+	size_t slotSize;
+	int count;
+	atomic_int position[RING_STAGES];
+	// Waiting stages sleep here until another stage moves or the pipeline is aborted
+	struct parking moved;
+};
+int ringInit(struct ring *r, size_t slotSize)
+{
+	(*r).slots = arenaAlloc(threadArena, slotSize * RING_ROWS);
+	(*r).slotSize = slotSize;
+	(*r).count = RING_ROWS;
+	for (int s = 0; s < RING_STAGES; s++)
+	{
+		atomic_init(&(*r).position[s], 0);
+	}
+	parkInit(&(*r).moved);
+	return (*r).slots == NULL ? -1 : 0;
+}
+void ringFree(struct ring *r)
+{
+	parkFree(&(*r).moved);
+}
+unsigned char *ringSlot(struct ring *r, int at)
+{
+	return (*r).slots + (size_t)(at % (*r).count) * (*r).slotSize;
+}
+int ringReady(struct ring *r, int stage, int at)
+{
+	if (stage == 0)
+	{
+		return at - atomic_load_explicit(&(*r).position[RING_STAGES - 1], memory_order_acquire) < (*r).count - 1;
+	}
+	return atomic_load_explicit(&(*r).position[stage - 1], memory_order_acquire) > at;
+}
+// Returns the next slot of the stage or NULL if the pipeline was aborted
+unsigned char *ringNext(struct ring *r, int stage, atomic_int *error)
+{
+	int at = atomic_load_explicit(&(*r).position[stage], memory_order_relaxed);
+	for (int spins = 0; !ringReady(r, stage, at); spins++)
+	{
+		if (atomic_load_explicit(error, memory_order_relaxed) != 0)
+		{
+			return NULL;
+		}
+		if (spins < RING_SPINS)
+		{
+			threadYield();
+			continue;
+		}
+		unsigned int ticket = parkTicket(&(*r).moved);
+		if (!ringReady(r, stage, at) && atomic_load(error) == 0)
+		{
+			parkWait(&(*r).moved, ticket);
+		}
+		else
+		{
+			parkCancel(&(*r).moved);
+		}
+	}
+	return ringSlot(r, at);
+}
+// Hands the slot of the stage on to the next one
+void ringDone(struct ring *r, int stage)
+{
+	atomic_fetch_add_explicit(&(*r).position[stage], 1, memory_order_release);
+	parkNotify(&(*r).moved);
+}
+// Stages of the pipeline ring, a slot holds the filter type followed by the row
+enum
+{
+	RING_INFLATE,
+	RING_UNFILTER,
+	RING_COLLECT
+};
+struct pipeline
+{
+	struct image *buf;
+	int *par;
+	int type;
+	size_t rowBytes;
+	struct inflater *infl;
+	struct stats *stats;
+	struct ring rows;
+	atomic_int error;
+};
+// Aborts the pipeline with error and wakes the stages waiting for it
+void pipelineFail(struct pipeline *pl, int error)
+{
+	atomic_store(&(*pl).error, error);
+	parkNotify(&(*pl).rows.moved);
+}
+void *inflateStage(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct inflater *s = (*pl).infl;
+	threadStats = (*pl).stats;
+	int ret = inflaterInit(s, (*pl).buf, ((*pl).rowBytes + 1) * (*pl).par[1]);
+	if (ret != SUCCESS)
+	{
+		pipelineFail(pl, ret == ERROR_OUT_OF_MEMORY ? -5 : -4);
+		return NULL;
+	}
+	for (int j = 0; j < (*pl).par[1]; j++)
+	{
+		unsigned char *slot = ringNext(&(*pl).rows, RING_INFLATE, &(*pl).error);
+		if (slot == NULL)
+		{
+			break;
+		}
+		struct mark t = stageStart();
+		ret = inflaterRead(s, slot, (*pl).rowBytes + 1);
+		stageEnd(STAGE_INFLATE, t, 0, (*pl).rowBytes + 1);
+		if (ret != SUCCESS)
+		{
+			pipelineFail(pl, ret == ERROR_OUT_OF_MEMORY ? -5 : -4);
+			break;
+		}
+		ringDone(&(*pl).rows, RING_INFLATE);
+	}
+	if (threadStats != NULL)
+	{
+		(*threadStats).bytesIn[STAGE_INFLATE] += (*(*pl).buf).size;
+	}
+	inflaterEnd(s);
+	closeCounters();
+	return NULL;
+}
+// Unfilters every row in its slot below the row of the slot before
+void *unfilterStage(void *arg)
+{
+	struct pipeline *pl = arg;
+	size_t rowBytes = (*pl).rowBytes;
+	threadStats = (*pl).stats;
+	for (int j = 0; j < (*pl).par[1]; j++)
+	{
+		unsigned char *slot = ringNext(&(*pl).rows, RING_UNFILTER, &(*pl).error);
+		if (slot == NULL)
+		{
+			break;
+		}
+		struct mark t = stageStart();
+		unsigned char *prev = j == 0 ? NULL : ringSlot(&(*pl).rows, j - 1) + 1;
+		if (unfilterLine(slot[0], slot + 1, prev, rowBytes, (*pl).type) != 0)
+		{
+			pipelineFail(pl, -1);
+			break;
+		}
+		stageEnd(STAGE_UNFILTER, t, rowBytes + 1, rowBytes);
+		ringDone(&(*pl).rows, RING_UNFILTER);
+	}
+	closeCounters();
+	return NULL;
+}
+// Inflate and unfilter run on their own threads and pass the rows through a ring to the calling thread. Without f
+// it collects them into out2 (palette indices are left for writeBands to expand), with f the rows of a grayscale
+// image are final and are written to it as they come
+int pipelineRaw(int type, int par[], unsigned char *out2, struct image buf, int *asP5, struct inflater *infl, FILE *f)
+{
+	struct pipeline pl = { .buf = &buf, .par = par, .type = type, .rowBytes = (size_t)par[0] * type, .infl = infl };
+	pl.stats = threadStats;
+	unsigned char used[256] = { 0 };
+	atomic_init(&pl.error, 0);
+	if (ringInit(&pl.rows, pl.rowBytes + 1) != 0)
+	{
+		ringFree(&pl.rows);
+		return -3;
+	}
+	thread_t inflateThread;
+	thread_t unfilterThread;
+	if (threadCreate(&inflateThread, inflateStage, &pl) != 0)
+	{
+		ringFree(&pl.rows);
+		return -3;
+	}
+	if (threadCreate(&unfilterThread, unfilterStage, &pl) != 0)
+	{
+		pipelineFail(&pl, -3);
+		threadJoin(inflateThread);
+		ringFree(&pl.rows);
+		return -3;
+	}
+	if (f != NULL)
+	{
+		fprintf(f, "P5\n%i %i\n255\n", par[0], par[1]);
+	}
+	unsigned char *dst = out2;
+	for (int j = 0; j < par[1] && atomic_load(&pl.error) == 0; j++)
+	{
+		unsigned char *slot = ringNext(&pl.rows, RING_COLLECT, &pl.error);
+		if (slot == NULL)
+		{
+			break;
+		}
+		unsigned char *row = slot + 1;
+		struct mark t = stageStart();
+		if (f != NULL)
+		{
+			if (fwrite(row, 1, pl.rowBytes, f) != pl.rowBytes)
+			{
+				pipelineFail(&pl, -6);
+			}
+			stageEnd(STAGE_WRITE, t, pl.rowBytes, pl.rowBytes);
+			ringDone(&pl.rows, RING_COLLECT);
+			continue;
+		}
+		if (buf.type == 3 && markPallet(row, par[0], buf, used) != 0)
+		{
+			pipelineFail(&pl, -2);
+		}
+		else if (buf.type == 2 && *asP5 == 1 && rowChroma(row, par[0]) != 0)
+		{
+			*asP5 = 0;
+		}
+		memcpy(dst, row, pl.rowBytes);
+		dst += pl.rowBytes;
+		stageEnd(STAGE_EXPAND, t, pl.rowBytes, pl.rowBytes);
+		ringDone(&pl.rows, RING_COLLECT);
+	}
+	threadJoin(inflateThread);
+	threadJoin(unfilterThread);
+	ringFree(&pl.rows);
+	int ret = atomic_load(&pl.error);
+	if (ret != 0 || f != NULL)
+	{
+		return ret;
+	}
+	if (buf.type == 3)
+	{
+		*asP5 = palletIsGray(buf, used);
+	}
+	else if (buf.type == 2 && *asP5 == 1)
+	{
+		collapseGray(out2, (size_t)par[0] * par[1]);
+	}
+	return 0;
+}
+struct band
+{
+	FILE *f;
+	unsigned char *map;
+	long long offset;
+	const unsigned char *pixels;
+	int first;
+	int rows;
+	int *par;
+	struct image *buf;
+	int channels;
+	int error;
+	// Expansion buffer of BAND_CHUNK_ROWS rows, taken from the arena of the calling thread
+	unsigned char *chunk;
+};
+// Writes size bytes at an absolute offset of f without moving its position
+int writeAt(FILE *f, const unsigned char *data, size_t size, long long offset)
+{
+#if defined(_WIN32)
+	HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+	while (size > 0)
+	{
+		OVERLAPPED ov = { 0 };
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD chunk = size > (1u << 30) ? (1u << 30) : (DWORD)size;
+		DWORD written = 0;
+		if (!WriteFile(h, data, chunk, &written, &ov) || written == 0)
+		{
+			return -1;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+#else
+	int fd = fileno(f);
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written <= 0)
+		{
+			return -1;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+#endif
+	return 0;
+}
+// Reserves the whole output up front so parallel writes don't extend the file one by one
+void preallocate(FILE *f, long long size)
+{
+#if defined(__linux__)
+	posix_fallocate(fileno(f), 0, size);
+#endif
+}
+// Maps the whole output file for writing, returns NULL when mapping is not available
+unsigned char *mapOutput(FILE *f, long long size)
+{
+#if defined(_WIN32)
+	return NULL;
+#else
+	if (ftruncate(fileno(f), size) != 0)
+	{
+		return NULL;
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+	return map == MAP_FAILED ? NULL : map;
+#endif
+}
+void unmapOutput(unsigned char *map, long long size)
+{
+#if !defined(_WIN32)
+	munmap(map, size);
+#endif
+}
+#define BAND_CHUNK_ROWS 64
+void *bandStage(void *arg)
+{
+	struct band *b = arg;
+	size_t rowOut = (size_t)(*b).par[0] * (*b).channels;
+	int width = (*b).par[0];
+	int expand = (*(*b).buf).type == 3;
+	if (!expand)
+	{
+		const unsigned char *src = (*b).pixels + (*b).first * rowOut;
+		long long offset = (*b).offset + (long long)(*b).first * rowOut;
+		if ((*b).map != NULL)
+		{
+			memcpy((*b).map + offset, src, (*b).rows * rowOut);
+		}
+		else if (writeAt((*b).f, src, (*b).rows * rowOut, offset) != 0)
+		{
+			(*b).error = -6;
+		}
+		return NULL;
+	}
+	int chunkRows = (*b).rows < BAND_CHUNK_ROWS ? (*b).rows : BAND_CHUNK_ROWS;
+	unsigned char *chunk = (*b).chunk;
+	for (int j = 0; j < (*b).rows; j += chunkRows)
+	{
+		int rows = (*b).rows - j < chunkRows ? (*b).rows - j : chunkRows;
+		const unsigned char *indices = (*b).pixels + (size_t)((*b).first + j) * width;
+		long long offset = (*b).offset + (long long)((*b).first + j) * rowOut;
+		unsigned char *dst = (*b).map != NULL ? (*b).map + offset : chunk;
+		expandPallet(dst, indices, width, rows, width, *(*b).buf, (*b).channels == 1);
+		if ((*b).map == NULL && writeAt((*b).f, chunk, rows * rowOut, offset) != 0)
+		{
+			(*b).error = -6;
+			break;
+		}
+	}
+	return NULL;
+}
+// Writes the PNM in row bands on separate threads or as pool tasks, each band lands at its precomputed offset after
+// the header. Palette indices in out2 are expanded by the bands themselves.
+int writeBands(FILE *f, unsigned char *out2, struct image buf, int asP5, int par[], int threads, int useMap)
+{
+	int channels = asP5 ? 1 : 3;
+	fprintf(f, channels == 1 ? "P5\n" : "P6\n");
+	fprintf(f, "%i %i\n", par[0], par[1]);
+	fprintf(f, "255\n");
+	fflush(f);
+	long long header = ftell(f);
+	long long total = header + (long long)par[0] * par[1] * channels;
+	unsigned char *map = useMap ? mapOutput(f, total) : NULL;
+	if (map == NULL)
+	{
+		preallocate(f, total);
+	}
+	if (threads > par[1])
+	{
+		threads = par[1] > 0 ? par[1] : 1;
+	}
+	struct band *bands = calloc(threads, sizeof(struct band));
+	if (bands == NULL)
+	{
+		if (map != NULL)
+		{
+			unmapOutput(map, total);
+		}
+		return -3;
+	}
+	int ret = 0;
+	for (int t = 0; t < threads && ret == 0; t++)
+	{
+		bands[t] = (struct band){ .f = f, .map = map, .offset = header, .pixels = out2, .par = par, .buf = &buf };
+		bands[t].channels = channels;
+		bands[t].first = (long long)par[1] * t / threads;
+		bands[t].rows = (long long)par[1] * (t + 1) / threads - bands[t].first;
+		if (buf.type == 3 && map == NULL)
+		{
+			int chunkRows = bands[t].rows < BAND_CHUNK_ROWS ? bands[t].rows : BAND_CHUNK_ROWS;
+			bands[t].chunk = arenaAlloc(threadArena, (size_t)chunkRows * par[0] * channels);
+			ret = bands[t].chunk == NULL ? -3 : 0;
+		}
+	}
+	if (ret == 0)
+	{
+		forkJoin(bandStage, bands, sizeof(struct band), threads);
+	}
+	for (int t = 0; t < threads; t++)
+	{
+		if (bands[t].error != 0)
+		{
+			ret = bands[t].error;
+		}
+	}
+	if (map != NULL)
+	{
+		unmapOutput(map, total);
+	}
+	free(bands);
+	return ret;
+}
+// Bounded-memory decode for --max-memory: keeps two filtered rows instead of the whole image and writes every row
+// once it is unfiltered. RGB and palette images are inflated twice, the first pass only decides whether P5 fits
+int streamRaw(FILE *f, int type, int par[], struct image buf, struct inflater *infl, int *asP5)
+{
+	size_t rowBytes = (size_t)par[0] * type;
+	unsigned char *lines = arenaAlloc(threadArena, 2 * (rowBytes + 1) + (size_t)par[0] * 3);
+	if (lines == NULL)
+	{
+		return -3;
+	}
+	unsigned char *out = lines + 2 * (rowBytes + 1);
+	unsigned char used[256] = { 0 };
+	unsigned char chroma = 0;
+	int ret = 0;
+	for (int pass = buf.type == 0; pass < 2 && ret == 0; pass++)
+	{
+		ret = inflaterInit(infl, &buf, (rowBytes + 1) * par[1]);
+		if (ret != SUCCESS)
+		{
+			ret = ret == ERROR_OUT_OF_MEMORY ? -5 : -4;
+			break;
+		}
+		if (pass == 1)
+		{
+			*asP5 = buf.type == 3 ? palletIsGray(buf, used) : chroma == 0;
+			fprintf(f, "P%c\n%i %i\n255\n", *asP5 ? '5' : '6', par[0], par[1]);
+		}
+		for (int j = 0; j < par[1] && ret == 0; j++)
+		{
+			unsigned char *cur = lines + (j % 2) * (rowBytes + 1);
+			unsigned char *prev = lines + (1 - j % 2) * (rowBytes + 1);
+			struct mark t = stageStart();
+			ret = inflaterRead(infl, cur, rowBytes + 1);
+			stageEnd(STAGE_INFLATE, t, 0, rowBytes + 1);
+			if (ret != SUCCESS)
+			{
+				ret = ret == ERROR_OUT_OF_MEMORY ? -5 : -4;
+				break;
+			}
+			t = stageStart();
+			if (unfilterLine(cur[0], cur + 1, j == 0 ? NULL : prev + 1, rowBytes, type) != 0)
+			{
+				ret = -1;
+				break;
+			}
+			stageEnd(STAGE_UNFILTER, t, rowBytes + 1, rowBytes);
+			if (pass == 0 && buf.type == 3)
+			{
+				ret = markPallet(cur + 1, par[0], buf, used);
+				continue;
+			}
+			else if (pass == 0)
+			{
+				chroma |= rowChroma(cur + 1, par[0]);
+				continue;
+			}
+			t = stageStart();
+			unsigned char *row = out;
+			size_t rowOut = (size_t)par[0] * (*asP5 ? 1 : 3);
+			if (buf.type == 3)
+			{
+				expandPallet(out, cur + 1, 0, 1, par[0], buf, *asP5);
+			}
+			else if (buf.type == 2 && *asP5)
+			{
+				for (int k = 0; k < par[0]; k++)
+				{
+					out[k] = cur[1 + 3 * k];
+				}
+			}
+			else
+			{
+				row = cur + 1;
+			}
+			stageEnd(STAGE_EXPAND, t, rowBytes, rowOut);
+			t = stageStart();
+			ret = fwrite(row, 1, rowOut, f) == rowOut ? 0 : -6;
+			stageEnd(STAGE_WRITE, t, rowOut, rowOut);
+		}
+		inflaterEnd(infl);
+	}
+	return ret;
+}
+struct options
+{
+	int scale;
+	int preview;
+	int threads;
+	int useMap;
+	// --max-memory in bytes, 0 when unlimited
+	size_t maxMemory;
+	// --max-pixels refuses larger images right after IHDR, 0 when unlimited. Images whose buffers would exceed
+	// --max-bytes are decoded row by row, or refused when that is not possible
+	size_t maxPixels;
+	size_t maxBytes;
+	int stats;
+	int counters;
+	int batch;
+	// Set when the input or the output is -, the input may hold several PNGs one after another
+	int concatenated;
+	// --no-io-uring: batch workers open, read and write their files themselves
+	int syncIo;
+	// --cache directory, its size limit (0 for the default) and --cache-link
+	char *cache;
+	size_t cacheSize;
+	int cacheLink;
+	char *trace;
+	char *daemon;
+	char *input;
+	char *output;
+	// Batch mode: input/output pairs
+	char **files;
+	int fileCount;
+};
+// Parses a positive number with an optional K, M or G binary suffix
+int parseSize(const char *text, size_t *value)
+{
+	char *end;
+	unsigned long long number = strtoull(text, &end, 10);
+	int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+	end += shift != 0;
+	if (*end != '\0' || number == 0 || *text == '-' || number > (SIZE_MAX >> shift))
+	{
+		return -1;
+	}
+	*value = (size_t)number << shift;
+	return 0;
+}
+struct pair parseOptions(int argc, char *argv[], struct options *opt)
+{
+	struct pair ans = { 0, SUCCESS };
+	int positional = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--scale=", 8) == 0)
+		{
+			char *value = argv[i] + 8;
+			if (strncmp(value, "1/", 2) == 0)
+			{
+				value += 2;
+			}
+			char *end;
+			long scale = strtol(value, &end, 10);
+			if (*end != '\0' || scale < 1 || scale > 65536)
+			{
+				makeError(&ans, "Scale must be a positive integer factor like 2 or 1/2\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+			(*opt).scale = scale;
+		}
+		else if (strncmp(argv[i], "--preview=", 10) == 0)
+		{
+			char *end;
+			long passes = strtol(argv[i] + 10, &end, 10);
+			if (*end != '\0' || passes < 1 || passes > 7)
+			{
+				makeError(&ans, "Preview must be an Adam7 pass number from 1 to 7\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+			(*opt).preview = passes;
+		}
+		else if (strncmp(argv[i], "--threads=", 10) == 0)
+		{
+			char *end;
+			long threads = strtol(argv[i] + 10, &end, 10);
+			if (*end != '\0' || threads < 1 || threads > 1024)
+			{
+				makeError(&ans, "Threads must be a number from 1 to 1024\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+			(*opt).threads = threads;
+		}
+		else if (strncmp(argv[i], "--daemon=", 9) == 0)
+		{
+			(*opt).daemon = argv[i] + 9;
+		}
+		else if (strcmp(argv[i], "--mmap") == 0)
+		{
+			(*opt).useMap = 1;
+		}
+		else if (strcmp(argv[i], "--no-huge-pages") == 0)
+		{
+			hugePages = 0;
+		}
+		else if (strcmp(argv[i], "--no-io-uring") == 0)
+		{
+			(*opt).syncIo = 1;
+		}
+		else if (strncmp(argv[i], "--max-memory=", 13) == 0)
+		{
+			if (parseSize(argv[i] + 13, &(*opt).maxMemory) != 0)
+			{
+				makeError(&ans, "Memory budget must be a size like 4096, 64K, 512M or 2G\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+		}
+		else if (strncmp(argv[i], "--max-pixels=", 13) == 0)
+		{
+			if (parseSize(argv[i] + 13, &(*opt).maxPixels) != 0)
+			{
+				makeError(&ans, "Pixel limit must be a count like 1000000, 64M or 1G\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+		}
+		else if (strncmp(argv[i], "--max-bytes=", 12) == 0)
+		{
+			if (parseSize(argv[i] + 12, &(*opt).maxBytes) != 0)
+			{
+				makeError(&ans, "Decoded size limit must be a size like 64M or 2G\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+		}
+		else if (strcmp(argv[i], "--stats") == 0)
+		{
+			(*opt).stats = 1;
+		}
+		else if (strcmp(argv[i], "--counters") == 0)
+		{
+			(*opt).stats = 1;
+			(*opt).counters = 1;
+		}
+		else if (strcmp(argv[i], "--batch") == 0)
+		{
+			(*opt).batch = 1;
+		}
+		else if (strncmp(argv[i], "--cache=", 8) == 0)
+		{
+			(*opt).cache = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--cache-size=", 13) == 0)
+		{
+			if (parseSize(argv[i] + 13, &(*opt).cacheSize) != 0)
+			{
+				makeError(&ans, "Cache size must be a size like 512M or 4G\n", ERROR_PARAMETER_INVALID);
+				return ans;
+			}
+		}
+		else if (strcmp(argv[i], "--cache-link") == 0)
+		{
+			(*opt).cacheLink = 1;
+		}
+		else if (strncmp(argv[i], "--trace=", 8) == 0)
+		{
+			(*opt).trace = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--", 2) == 0)
+		{
+			makeError(&ans, "Unknown option\n", ERROR_PARAMETER_INVALID);
+			return ans;
+		}
+		else if ((*opt).batch && (*opt).files != NULL && argv + i != (*opt).files + positional)
+		{
+			makeError(&ans, "Files must come after the options\n", ERROR_PARAMETER_INVALID);
+			return ans;
+		}
+		else if (positional == 0)
+		{
+			(*opt).input = argv[i];
+			(*opt).files = argv + i;
+			positional++;
+		}
+		else if (positional == 1)
+		{
+			(*opt).output = argv[i];
+			positional++;
+		}
+		else
+		{
+			positional++;
+		}
+	}
+	(*opt).fileCount = positional;
+	if ((*opt).daemon != NULL && (positional != 0 || (*opt).batch))
+	{
+		makeError(&ans, "Daemon mode takes no file arguments\n", ERROR_PARAMETER_INVALID);
+	}
+	else if ((*opt).batch && (positional == 0 || positional % 2 != 0))
+	{
+		makeError(&ans, "Batch mode expects pairs of input and output files\n", ERROR_PARAMETER_INVALID);
+	}
+	else if ((*opt).daemon == NULL && !(*opt).batch && positional != 2)
+	{
+		makeError(&ans, "Wrong number of arguments expected 2\n", ERROR_PARAMETER_INVALID);
+	}
+	else if ((*opt).scale > 1 && (*opt).preview != 0)
+	{
+		makeError(&ans, "Scale and preview cannot be combined\n", ERROR_PARAMETER_INVALID);
+	}
+	else if ((*opt).cache == NULL && ((*opt).cacheSize != 0 || (*opt).cacheLink))
+	{
+		makeError(&ans, "Cache size and links need a --cache directory\n", ERROR_PARAMETER_INVALID);
+	}
+	else if ((*opt).daemon == NULL && !(*opt).batch)
+	{
+		(*opt).concatenated = strcmp((*opt).input, "-") == 0 || strcmp((*opt).output, "-") == 0;
+	}
+	return ans;
+}
+void checkFree(unsigned char *f)
+{
+	if (f != NULL)
+	{
+		release(f);
+	}
+}
+// Buffers and decompressor kept between conversions by long-running workers
+struct context
+{
+	struct inflater infl;
+	unsigned char *data;
+	size_t dataCapacity;
+	unsigned char *out1;
+	size_t out1Capacity;
+	unsigned char *out2;
+	size_t out2Capacity;
+	unsigned char *input;
+	size_t inputCapacity;
+	// Bytes of the input being converted when it is already in memory, its IDAT chunks are inflated in place
+	const unsigned char *source;
+	struct arena arena;
+};
+// Returns a buffer of at least size bytes, reusing *p when it is already big enough
+unsigned char *reserve(unsigned char **p, size_t *capacity, size_t size)
+{
+	if (size > *capacity || *p == NULL)
+	{
+		release(*p);
+		*p = allocate(size > 0 ? size : 1);
+		*capacity = *p == NULL ? 0 : size;
+	}
+	return *p;
+}
+void contextFree(struct context *ctx)
+{
+	inflaterFree(&(*ctx).infl);
+	checkFree((*ctx).data);
+	checkFree((*ctx).out1);
+	checkFree((*ctx).out2);
+	checkFree((*ctx).input);
+	arenaFree(&(*ctx).arena);
+}
+struct pair rawError(int ret)
+{
+	struct pair ans = { 0, SUCCESS };
+	if (ret == -1)
+	{
+		makeError(&ans, "Unsupported filter, only support filter None\n", ERROR_UNSUPPORTED);
+	}
+	else if (ret == -2)
+	{
+		makeError(&ans, "Pallet index greater than its size\n", ERROR_DATA_INVALID);
+	}
+	else if (ret == -3)
+	{
+		makeError(&ans, "Not enough memory for decoded rows\n", ERROR_OUT_OF_MEMORY);
+	}
+	else if (ret == -4)
+	{
+		makeError(&ans, "Wrong IDAT chunk data\n", ERROR_DATA_INVALID);
+	}
+	else if (ret == -5)
+	{
+		makeError(&ans, "Not enough memory to decompress\n", ERROR_OUT_OF_MEMORY);
+	}
+	else
+	{
+		makeError(&ans, "Cannot write output file\n", ERROR_UNKNOWN);
+	}
+	return ans;
+}
+// Where a conversion goes: a file, or a caller-provided memory slot the PNM is decoded into in place
+struct output
+{
+	const char *path;
+	// Standard output or the file of a multi-image stream, left open after each image and never removed
+	FILE *stream;
+	unsigned char *memory;
+	size_t capacity;
+	size_t size;
+	// Where --cache keeps the PNM: a hash of IHDR, PLTE and IDAT and the IDAT size, see cacheKey
+	uint64_t key;
+	size_t idat;
+	int cached;
+};
+// The input of a stream stays open for the next image
+void closeInput(FILE *f, struct options opt)
+{
+	if (!opt.concatenated)
+	{
+		fclose(f);
+	}
+}
+// Closes an input whose IDAT data was read back from the file, once decoding is done with it
+void endInput(struct image *buf, long after, struct options opt)
+{
+	if ((*buf).file != NULL)
+	{
+		fseek((*buf).file, after, SEEK_SET);
+		closeInput((*buf).file, opt);
+		(*buf).file = NULL;
+	}
+}
+// Removes an output that is one of several links to a file, like an entry of --cache-link, so that writing it
+// creates a new file instead of changing the others
+void unshareOutput(const char *path)
+{
+#if !defined(_WIN32)
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+	{
+		remove(path);
+	}
+#endif
+}
+FILE *openOutput(struct output *output)
+{
+	if ((*output).stream != NULL)
+	{
+		return (*output).stream;
+	}
+	unshareOutput((*output).path);
+	return fopen((*output).path, "wb");
+}
+int closeOutput(struct output *output, FILE *f)
+{
+	return f == (*output).stream ? (ferror(f) ? EOF : 0) : fclose(f);
+}
+void discardOutput(struct output *output)
+{
+	if ((*output).stream == NULL)
+	{
+		remove((*output).path);
+	}
+}
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+#define HASH_P4 0x85EBCA77C2B2AE63ULL
+#define HASH_P5 0x27D4EB2F165667C5ULL
+uint64_t hashRotate(uint64_t x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+uint64_t hashRead(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+	return hashRotate(acc + input * HASH_P2, 31) * HASH_P1;
+}
+// Incremental XXH64: whole 32-byte stripes go through the four independent lanes, which run at several GB/s, far
+// ahead of inflate, so the IDAT data can be hashed piece by piece before deciding to decode it
+struct hashState
+{
+	uint64_t v[4];
+	uint64_t seed;
+	uint64_t total;
+	unsigned char tail[32];
+	size_t tailSize;
+};
+struct hashState hashInit(uint64_t seed)
+{
+	return (struct hashState){
+		.v = { seed + HASH_P1 + HASH_P2, seed + HASH_P2, seed, seed - HASH_P1 },
+		.seed = seed,
+	};
+}
+void hashStripe(struct hashState *h, const unsigned char *p)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		(*h).v[i] = hashRound((*h).v[i], hashRead(p + 8 * i));
+	}
+}
+void hashUpdate(struct hashState *h, const unsigned char *p, size_t size)
+{
+	(*h).total += size;
+	if ((*h).tailSize > 0)
+	{
+		size_t n = sizeof((*h).tail) - (*h).tailSize;
+		n = n < size ? n : size;
+		memcpy((*h).tail + (*h).tailSize, p, n);
+		(*h).tailSize += n;
+		p += n;
+		size -= n;
+		if ((*h).tailSize < sizeof((*h).tail))
+		{
+			return;
+		}
+		hashStripe(h, (*h).tail);
+		(*h).tailSize = 0;
+	}
+	for (; size >= 32; p += 32, size -= 32)
+	{
+		hashStripe(h, p);
+	}
+	memcpy((*h).tail, p, size);
+	(*h).tailSize = size;
+}
+uint64_t hashDigest(struct hashState *s)
+{
+	const unsigned char *p = (*s).tail;
+	const unsigned char *end = p + (*s).tailSize;
+	uint64_t h = (*s).seed + HASH_P5;
+	if ((*s).total >= 32)
+	{
+		h = hashRotate((*s).v[0], 1) + hashRotate((*s).v[1], 7) + hashRotate((*s).v[2], 12) +
+			hashRotate((*s).v[3], 18);
+		for (int i = 0; i < 4; i++)
+		{
+			h = (h ^ hashRound(0, (*s).v[i])) * HASH_P1 + HASH_P4;
+		}
+	}
+	h += (*s).total;
+	for (; end - p >= 8; p += 8)
+	{
+		h = hashRotate(h ^ hashRound(0, hashRead(p)), 27) * HASH_P1 + HASH_P4;
+	}
+	if (end - p >= 4)
+	{
+		uint32_t k;
+		memcpy(&k, p, sizeof(k));
+		h = hashRotate(h ^ k * HASH_P1, 23) * HASH_P2 + HASH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+	{
+		h = hashRotate(h ^ *p * HASH_P5, 11) * HASH_P1;
+	}
+	h = (h ^ h >> 33) * HASH_P2;
+	h = (h ^ h >> 29) * HASH_P3;
+	return h ^ h >> 32;
+}
+// XXH64 of size bytes
+uint64_t hash64(const unsigned char *p, size_t size, uint64_t seed)
+{
+	struct hashState h = hashInit(seed);
+	hashUpdate(&h, p, size);
+	return hashDigest(&h);
+}
+// Everything that decides the PNM: the IHDR fields, the palette, the IDAT data and the options that change the output.
+// Ancillary chunks are skipped by the decoder and so are not part of the key. The IDAT data is read where it lies,
+// so input kept in memory is hashed without gathering it
+uint64_t cacheKey(struct image *buf, int par[], struct options opt)
+{
+	int fields[6] = { par[0], par[1], (*buf).type, (*buf).interlace, opt.scale, opt.preview };
+	unsigned char head[sizeof(fields) + 256 * 3];
+	memcpy(head, fields, sizeof(fields));
+	if ((*buf).plteSize > 0)
+	{
+		memcpy(head + sizeof(fields), (*buf).plteData, (*buf).plteSize * 3);
+	}
+	struct hashState h = hashInit(hash64(head, sizeof(fields) + (*buf).plteSize * 3, 0));
+	struct idatReader r;
+	idatStart(&r, buf);
+	for (;;)
+	{
+		const unsigned char *data;
+		size_t size;
+		idatNext(&r, &data, &size);
+		if (r.ended)
+		{
+			break;
+		}
+		hashUpdate(&h, data, size);
+	}
+	return hashDigest(&h);
+}
+enum cacheResult
+{
+	CACHE_UNUSED,
+	CACHE_MISS,
+	CACHE_HIT
+};
+static const char *cacheNames[] = { "unused", "miss", "hit" };
+// On-disk cache of converted images shared by every worker, and by other processes using the same directory
+struct cache
+{
+	const char *dir;
+	size_t limit;
+	// --cache-link: hits and new entries are hard links instead of reflinks or copies. Outputs with other links are
+	// removed before they are written, see unshareOutput, and an entry changed through a link is dropped on lookup,
+	// see cacheStamp
+	int link;
+	// Bytes of all entries, recounted whenever the cache is trimmed
+	atomic_ullong bytes;
+	atomic_ullong hits;
+	atomic_ullong misses;
+	atomic_ullong evicted;
+	atomic_ullong temps;
+	// Held by the thread trimming the cache, the others carry on without waiting for it
+	atomic_flag trimming;
+};
+static struct cache *conversionCache;
+#define CACHE_PATH 4096
+// Temporary files left behind by a crashed writer are removed once they are this old
+#define CACHE_STALE_SECONDS 3600
+#if !defined(_WIN32)
+// The entry of a conversion with the extension pnm, its stamp with link
+void cachePath(struct cache *c, char *path, uint64_t key, size_t idat, const char *extension)
+{
+	snprintf(path, CACHE_PATH, "%s/%016llx-%zx.%s", (*c).dir, (unsigned long long)key, idat, extension);
+}
+// Records the size and the modification time of a linked entry in its stamp. Any link to the entry can be written
+// by whoever owns it, the entry is served only while it still matches, see cacheStamped
+int cacheStamp(struct cache *c, uint64_t key, size_t idat, struct stat *st)
+{
+	char path[CACHE_PATH];
+	char temp[CACHE_PATH];
+	cachePath(c, path, key, idat, "link");
+	snprintf(temp,
+			 CACHE_PATH,
+			 "%s/.%ld-%llu.tmp",
+			 (*c).dir,
+			 (long)getpid(),
+			 atomic_fetch_add(&(*c).temps, 1));
+	FILE *f = fopen(temp, "w");
+	if (f == NULL)
+	{
+		return -1;
+	}
+	fprintf(f, "%lld %lld %ld\n", (long long)(*st).st_size, (long long)(*st).st_mtim.tv_sec, (*st).st_mtim.tv_nsec);
+	if (fclose(f) != 0 || rename(temp, path) != 0)
+	{
+		unlink(temp);
+		return -1;
+	}
+	return 0;
+}
+// Returns 0 when the entry st is as its stamp recorded it
+int cacheStamped(struct cache *c, uint64_t key, size_t idat, struct stat *st)
+{
+	char path[CACHE_PATH];
+	cachePath(c, path, key, idat, "link");
+	FILE *f = fopen(path, "r");
+	long long size = -1;
+	long long seconds = -1;
+	long nanoseconds = -1;
+	if (f != NULL)
+	{
+		if (fscanf(f, "%lld %lld %ld", &size, &seconds, &nanoseconds) != 3)
+		{
+			size = -1;
+		}
+		fclose(f);
+	}
+	int same = size == (long long)(*st).st_size && seconds == (long long)(*st).st_mtim.tv_sec;
+	return same && nanoseconds == (*st).st_mtim.tv_nsec ? 0 : -1;
+}
+struct cacheFile
+{
+	time_t used;
+	unsigned long long size;
+	char name[64];
+};
+int compareUsed(const void *a, const void *b)
+{
+	time_t x = (*(const struct cacheFile *)a).used;
+	time_t y = (*(const struct cacheFile *)b).used;
+	return (x > y) - (x < y);
+}
+// Recounts the entries and, over the limit, removes the least recently used ones down to three quarters of it, so
+// the directory is scanned once per quarter of the limit written rather than after every new entry
+void cacheTrim(struct cache *c)
+{
+	if (atomic_flag_test_and_set(&(*c).trimming))
+	{
+		return;
+	}
+	DIR *d = opendir((*c).dir);
+	struct cacheFile *files = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	unsigned long long total = 0;
+	time_t stale = time(NULL) - CACHE_STALE_SECONDS;
+	struct dirent *e;
+	while (d != NULL && (e = readdir(d)) != NULL)
+	{
+		size_t length = strlen((*e).d_name);
+		struct stat st;
+		if (length < 4 || length >= sizeof(files[0].name) - 1 || fstatat(dirfd(d), (*e).d_name, &st, 0) != 0 ||
+			!S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+		if (strcmp((*e).d_name + length - 4, ".tmp") == 0 && st.st_mtime < stale)
+		{
+			unlinkat(dirfd(d), (*e).d_name, 0);
+		}
+		if (strcmp((*e).d_name + length - 4, ".pnm") != 0)
+		{
+			continue;
+		}
+		if (count == capacity)
+		{
+			capacity = capacity == 0 ? 256 : capacity * 2;
+			struct cacheFile *t = realloc(files, capacity * sizeof(struct cacheFile));
+			if (t == NULL)
+			{
+				break;
+			}
+			files = t;
+		}
+		files[count].used = st.st_atime;
+		files[count].size = st.st_size;
+		strcpy(files[count].name, (*e).d_name);
+		total += st.st_size;
+		count++;
+	}
+	if (total > (*c).limit && files != NULL)
+	{
+		qsort(files, count, sizeof(struct cacheFile), compareUsed);
+		for (size_t i = 0; i < count && total > (*c).limit / 4 * 3; i++)
+		{
+			if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+			{
+				total -= files[i].size;
+				atomic_fetch_add(&(*c).evicted, 1);
+			}
+			// The stamp of a linked entry
+			strcpy(files[i].name + strlen(files[i].name) - 3, "link");
+			unlinkat(dirfd(d), files[i].name, 0);
+		}
+	}
+	atomic_store(&(*c).bytes, total);
+	free(files);
+	if (d != NULL)
+	{
+		closedir(d);
+	}
+	atomic_flag_clear(&(*c).trimming);
+}
+int cacheOpen(struct cache *c, struct options opt)
+{
+	*c = (struct cache){ .dir = opt.cache, .limit = opt.cacheSize, .link = opt.cacheLink };
+	(*c).limit = (*c).limit == 0 ? DEFAULT_CACHE_BYTES : (*c).limit;
+	atomic_flag_clear(&(*c).trimming);
+	DIR *d = NULL;
+	if (strlen(opt.cache) < CACHE_PATH - 64 && (mkdir(opt.cache, 0777) == 0 || errno == EEXIST))
+	{
+		d = opendir(opt.cache);
+	}
+	if (d == NULL)
+	{
+		fprintf(stderr, "Cannot open cache directory\n");
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	closedir(d);
+	cacheTrim(c);
+	return SUCCESS;
+}
+// Copies the rest of from into to: a reflink where the file system can share extents, an in-kernel copy on Linux
+// otherwise, and read and write as the last resort
+int copyFile(int from, int to)
+{
+#	if defined(__linux__)
+	if (ioctl(to, FICLONE, from) == 0)
+	{
+		return 0;
+	}
+	ssize_t copied;
+	while ((copied = copy_file_range(from, NULL, to, NULL, (size_t)1 << 30, 0)) > 0)
+	{
+	}
+	if (copied == 0)
+	{
+		return 0;
+	}
+#	endif
+	unsigned char chunk[1 << 16];
+	ssize_t got;
+	while ((got = read(from, chunk, sizeof(chunk))) > 0)
+	{
+		for (ssize_t done = 0, written; done < got; done += written)
+		{
+			if ((written = write(to, chunk + done, got - done)) <= 0)
+			{
+				return -1;
+			}
+		}
+	}
+	return got == 0 ? 0 : -1;
+}
+// Writes the cached PNM of the conversion to output. Returns 1 on a hit, 0 on a miss and a rawError code when the
+// entry was found but the output could not be written
+int cacheFetch(struct cache *c, struct output *output)
+{
+	char path[CACHE_PATH];
+	cachePath(c, path, (*output).key, (*output).idat, "pnm");
+	int from = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (from >= 0 && fstat(from, &st) != 0)
+	{
+		close(from);
+		from = -1;
+	}
+	// Other links to the entry are outputs of --cache-link, one of them may have been written since
+	if (from >= 0 && st.st_nlink > 1 && cacheStamped(c, (*output).key, (*output).idat, &st) != 0)
+	{
+		close(from);
+		from = -1;
+		unlink(path);
+	}
+	if (from >= 0 && (*output).memory != NULL && (size_t)st.st_size > (*output).capacity)
+	{
+		close(from);
+		from = -1;
+	}
+	if (from < 0)
+	{
+		atomic_fetch_add(&(*c).misses, 1);
+		return 0;
+	}
+	// The access time of an entry is its last use for cacheTrim, the modification time is left for cacheStamped
+	struct timespec used[2] = { { .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_OMIT } };
+	futimens(from, used);
+	atomic_fetch_add(&(*c).hits, 1);
+	(*output).size = st.st_size;
+	int ret = 0;
+	if ((*output).memory != NULL)
+	{
+		for (size_t done = 0, got; done < (*output).size && ret == 0; done += got)
+		{
+			ssize_t r = read(from, (*output).memory + done, (*output).size - done);
+			ret = r <= 0 ? -6 : 0;
+			got = r <= 0 ? 0 : r;
+		}
+	}
+	else if ((*output).stream != NULL)
+	{
+		unsigned char chunk[1 << 16];
+		ssize_t got;
+		while ((got = read(from, chunk, sizeof(chunk))) > 0 && fwrite(chunk, 1, got, (*output).stream) == (size_t)got)
+		{
+		}
+		ret = got != 0 || ferror((*output).stream) ? -6 : 0;
+	}
+	else
+	{
+		remove((*output).path);
+		if (!(*c).link || link(path, (*output).path) != 0)
+		{
+			int to = open((*output).path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			ret = to < 0 || copyFile(from, to) != 0 ? -6 : 0;
+			ret = to >= 0 && close(to) != 0 ? -6 : ret;
+		}
+		if (ret != 0)
+		{
+			discardOutput(output);
+		}
+	}
+	close(from);
+	return ret == 0 ? 1 : ret;
+}
+// Adds the PNM just written to output. It is written to a temporary file and renamed into place, so readers, other
+// processes included, never see a partial entry. A stream has already gone by and is not cached
+void cacheStore(struct cache *c, struct output *output)
+{
+	char path[CACHE_PATH];
+	char temp[CACHE_PATH];
+	cachePath(c, path, (*output).key, (*output).idat, "pnm");
+	struct stat st;
+	if ((*output).stream != NULL || stat(path, &st) == 0)
+	{
+		return;
+	}
+	if ((*c).link && (*output).memory == NULL)
+	{
+		if (link((*output).path, path) == 0)
+		{
+			if (stat(path, &st) == 0 && cacheStamp(c, (*output).key, (*output).idat, &st) == 0)
+			{
+				atomic_fetch_add(&(*c).bytes, st.st_size);
+			}
+			else
+			{
+				unlink(path);
+			}
+		}
+	}
+	else
+	{
+		snprintf(temp,
+				 CACHE_PATH,
+				 "%s/.%ld-%llu.tmp",
+				 (*c).dir,
+				 (long)getpid(),
+				 atomic_fetch_add(&(*c).temps, 1));
+		int to = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		int ret = to < 0 ? -1 : 0;
+		size_t size = (*output).size;
+		if (ret == 0 && (*output).memory != NULL)
+		{
+			for (size_t done = 0, written; done < size && ret == 0; done += written)
+			{
+				ssize_t w = write(to, (*output).memory + done, size - done);
+				ret = w <= 0 ? -1 : 0;
+				written = w <= 0 ? 0 : w;
+			}
+		}
+		else if (ret == 0)
+		{
+			int from = open((*output).path, O_RDONLY | O_CLOEXEC);
+			ret = from < 0 || fstat(from, &st) != 0 || copyFile(from, to) != 0 ? -1 : 0;
+			size = ret == 0 ? (size_t)st.st_size : 0;
+			if (from >= 0)
+			{
+				close(from);
+			}
+		}
+		ret = to >= 0 && close(to) != 0 ? -1 : ret;
+		if (ret == 0 && rename(temp, path) == 0)
+		{
+			atomic_fetch_add(&(*c).bytes, size);
+		}
+		else if (to >= 0)
+		{
+			unlink(temp);
+		}
+	}
+	if (atomic_load(&(*c).bytes) > (*c).limit)
+	{
+		cacheTrim(c);
+	}
+}
+#else
+int cacheOpen(struct cache *c, struct options opt)
+{
+	fprintf(stderr, "Conversion cache needs POSIX file links\n");
+	return ERROR_UNSUPPORTED;
+}
+int cacheFetch(struct cache *c, struct output *output)
+{
+	return 0;
+}
+void cacheStore(struct cache *c, struct output *output) {}
+#endif
+struct pair decode(FILE *f, struct output *output, struct options opt, struct context *ctx)
+{
+	struct pair ans = { 0, SUCCESS };
+	threadArena = &(*ctx).arena;
+	arenaReset(threadArena);
+	unsigned char data[9];
+	struct mark t = stageStart();
+	int ret = fread(data, 1, 8, f);
+	if (ret != 8)
+	{
+		closeInput(f, opt);
+		makeError(&ans, "Wrong data in the file\n", ERROR_DATA_INVALID);
+		return ans;
+	}
+	char str[16] = { data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] };
+	char sign[16] = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
+	if (strcmp(str, sign) != 0)
+	{
+		closeInput(f, opt);
+		makeError(&ans, "Wrong png image signature\n", ERROR_DATA_INVALID);
+		return ans;
+	}
+	stageEnd(STAGE_SIGNATURE, t, 8, 0);
+	int par[2] = { 0, 0 };
+	struct image buf = { .data = NULL, 100 };
+	t = stageStart();
+	struct ihdrRet ihdr = ihdrChunk(f, &buf, par);
+	stageEnd(STAGE_IHDR, t, 25, 0);
+	if (ihdr.returnCode != SUCCESS)
+	{
+		closeInput(f, opt);
+		makeError(&ans, ihdr.text, ihdr.returnCode);
+		return ans;
+	}
+	int type = ihdr.type;
+	if (buf.interlace != (opt.preview > 0))
+	{
+		closeInput(f, opt);
+		if (buf.interlace)
+		{
+			makeError(&ans, "Only support images without interlace\n", ERROR_UNSUPPORTED);
+		}
+		else
+		{
+			makeError(&ans, "Preview requires an interlaced image\n", ERROR_UNSUPPORTED);
+		}
+		return ans;
+	}
+	if (threadStats != NULL)
+	{
+		(*threadStats).width = par[0];
+		(*threadStats).height = par[1];
+	}
+	unsigned long long pixels = (unsigned long long)par[0] * par[1];
+	unsigned long long filtered = pixels * type + par[1];
+	if (opt.maxPixels > 0 && pixels > opt.maxPixels)
+	{
+		closeInput(f, opt);
+		makeError(&ans, "Image is refused by --max-pixels\n", ERROR_UNSUPPORTED);
+		return ans;
+	}
+	if (filtered > SIZE_MAX / 3)
+	{
+		closeInput(f, opt);
+		makeError(&ans, "Image is too large for the address space\n", ERROR_UNSUPPORTED);
+		return ans;
+	}
+	size_t size = (size_t)par[0] * par[1];
+	size_t rawSize = sizeof(unsigned char) * size * type + par[1];
+	// Full decodes inflate into 64-byte aligned rows, previews keep the packed passes
+	size_t out1Size = paddedSize(par, type);
+	if (opt.preview > 0)
+	{
+		rawSize = previewInput(par, type, PARTIAL_INFLATE ? opt.preview : 7);
+		out1Size = rawSize;
+	}
+	// The pipeline inflates rows on its own thread and scaling inflates them two at a time, so neither needs out1.
+	// The pipeline writes its bands at their offsets, which a stream does not have
+	int seekable = (*output).memory == NULL && (*output).stream == NULL;
+	int pipelined = opt.threads > 1 && opt.scale == 1 && opt.preview == 0 && seekable;
+	// Inside the batch pool large images are written in bands by the pool workers
+	int pooled = poolSelf >= 0 && poolWorkers > 1 && (size_t)par[0] * par[1] * type >= POOL_BAND_BYTES;
+	int banded = pipelined || (pooled && opt.scale == 1 && opt.preview == 0 && (*output).memory == NULL);
+	int bands = pipelined ? opt.threads : poolWorkers;
+	int outPar[2] = { par[0], par[1] };
+	if (opt.preview > 0)
+	{
+		previewSize(par, opt.preview, outPar);
+	}
+	else
+	{
+		scaledSize(par, opt.scale, outPar);
+	}
+	size_t outSize = (size_t)outPar[0] * outPar[1];
+	size_t out2Size = sizeof(unsigned char) * outSize * type * (2 * (buf.type == 3 && !banded) + 1);
+	// Palette images written to a file need no out2, only one expanded row
+	int fused = buf.type == 3 && opt.scale == 1 && opt.preview == 0 && !banded && (*output).memory == NULL;
+	if (fused)
+	{
+		out2Size = (size_t)par[0] * 3;
+	}
+	// Grayscale rows come out of the pipeline final and are written as they come, without out2
+	int direct = pipelined && buf.type == 0;
+	if (direct)
+	{
+		out2Size = 0;
+	}
+	// Buffers the chosen path allocates for the image, the compressed data aside
+	size_t whole = (*output).memory == NULL ? out2Size : 0;
+	if (banded)
+	{
+		// The palette expansion rows of every band
+		size_t bandRows = (size_t)bands * BAND_CHUNK_ROWS;
+		bandRows = bandRows < (size_t)par[1] ? bandRows : (size_t)par[1];
+		whole += buf.type == 3 && !opt.useMap ? bandRows * par[0] * 3 : 0;
+	}
+	if (pipelined)
+	{
+		// Ring slots
+		whole += RING_ROWS * ((size_t)par[0] * type + 1);
+	}
+	else if (opt.scale > 1)
+	{
+		// Two rows and the 64-bit sums of one row of boxes
+		whole += 2 * ((size_t)par[0] * type + 1) + (size_t)outPar[0] * 3 * sizeof(uint64_t);
+		whole += PARTIAL_INFLATE ? 0 : rawSize;
+	}
+	else
+	{
+		whole += out1Size + (PARTIAL_INFLATE || opt.preview > 0 ? 0 : rawSize);
+	}
+	int canStream = opt.scale == 1 && opt.preview == 0 && (*output).memory == NULL;
+	// Images whose buffers would exceed --max-bytes are decoded row by row, only scaling, previews and memory
+	// outputs have to refuse them
+	int streamed = whole > opt.maxBytes && canStream;
+	if (whole > opt.maxBytes && !streamed)
+	{
+		closeInput(f, opt);
+		makeError(&ans, "Image is refused by --max-bytes\n", ERROR_UNSUPPORTED);
+		return ans;
+	}
+	// With --max-memory, images whose buffers would not fit next to the compressed data are decoded row by row,
+	// the rest of the budget bounds the compressed data
+	if (opt.maxMemory > 0)
+	{
+		whole += INFLATER_MEMORY;
+		size_t rows = INFLATER_MEMORY + 2 * ((size_t)par[0] * type + 1) + (size_t)par[0] * 3;
+		rows += PARTIAL_INFLATE ? 0 : rawSize;
+		// A budget that leaves less than half for the compressed data reads it back through the small window
+		size_t window = rows + 2 * IDAT_WINDOW <= opt.maxMemory ? IDAT_WINDOW : IDAT_WINDOW_MIN;
+		rows += window;
+		// A pipe does not tell how much compressed data follows, so it is decoded row by row whenever it can be
+		size_t left = remainingBytes(f);
+		streamed = streamed || ((left == 0 || whole + left >= opt.maxMemory) && canStream);
+		size_t need = streamed ? rows : whole;
+		if (need >= opt.maxMemory)
+		{
+			closeInput(f, opt);
+			makeError(&ans, "Image does not fit the memory budget\n", ERROR_OUT_OF_MEMORY);
+			return ans;
+		}
+		buf.limit = opt.maxMemory - need;
+		if (streamed)
+		{
+			// Pooled buffers of earlier conversions count against the budget too
+			release((*ctx).out1);
+			release((*ctx).out2);
+			(*ctx).out1 = (*ctx).out2 = NULL;
+			(*ctx).out1Capacity = (*ctx).out2Capacity = 0;
+			// The compressed data of a seekable file stays there and is read back a window at a time, only a pipe
+			// has to be buffered
+			if (PARTIAL_INFLATE && left > 0 && (*ctx).source == NULL)
+			{
+				buf.window = arenaAlloc(threadArena, window);
+				buf.windowSize = window;
+				buf.file = buf.window != NULL ? f : NULL;
+			}
+		}
+	}
+	buf.data = (*ctx).data;
+	buf.capacity = (*ctx).dataCapacity;
+	buf.size = 0;
+	buf.concatenated = opt.concatenated;
+	buf.source = (*ctx).source;
+	if ((buf.limit > 0 && buf.capacity > buf.limit) || buf.file != NULL)
+	{
+		release(buf.data);
+		buf.data = NULL;
+		buf.capacity = 0;
+	}
+	// Chunks are counted from the position after IHDR, pipes have none and count the IDAT data instead
+	long chunks = ftell(f);
+	t = stageStart();
+	struct pair r = parsePNG(f, &buf);
+	stageEnd(STAGE_CHUNKS, t, chunks < 0 ? buf.size : (size_t)(ftell(f) - chunks), buf.size);
+	(*ctx).data = buf.data;
+	(*ctx).dataCapacity = buf.capacity;
+	// A stream of PNGs goes on after IEND, where the IDAT data read back from the file leaves it
+	long after = ftell(f);
+	if (buf.file == NULL || r.returnCode != SUCCESS || buf.size == 0)
+	{
+		closeInput(f, opt);
+		buf.file = NULL;
+	}
+	if (r.returnCode != SUCCESS)
+	{
+		return r;
+	}
+	if (buf.size == 0)
+	{
+		makeError(&ans, "No IDAT chunks found\n", ERROR_DATA_INVALID);
+		return ans;
+	}
+	if ((unsigned long long)buf.size * DEFLATE_MAX_RATIO + DEFLATE_MAX_RATIO < rawSize)
+	{
+		endInput(&buf, after, opt);
+		makeError(&ans, "IDAT data is too short for the image size\n", ERROR_DATA_INVALID);
+		return ans;
+	}
+	if (conversionCache != NULL)
+	{
+		t = stageStart();
+		(*output).key = cacheKey(&buf, par, opt);
+		(*output).idat = buf.size;
+		ret = cacheFetch(conversionCache, output);
+		(*output).cached = ret == 0 ? CACHE_MISS : CACHE_HIT;
+		stageEnd(STAGE_CACHE, t, buf.size, ret > 0 ? (*output).size : 0);
+		if (threadStats != NULL)
+		{
+			(*threadStats).cache = (*output).cached;
+		}
+		if (ret != 0)
+		{
+			endInput(&buf, after, opt);
+			return ret > 0 ? ans : rawError(ret);
+		}
+	}
+	if (streamed)
+	{
+		f = openOutput(output);
+		if (!f)
+		{
+			endInput(&buf, after, opt);
+			makeError(&ans, "Cannot open output file\n", ERROR_CANNOT_OPEN_FILE);
+			return ans;
+		}
+		int asP5 = 1;
+		ret = streamRaw(f, type, par, buf, &(*ctx).infl, &asP5);
+		endInput(&buf, after, opt);
+		ret = closeOutput(output, f) != 0 && ret == 0 ? -6 : ret;
+		if (ret != 0)
+		{
+			discardOutput(output);
+			return rawError(ret);
+		}
+		return ans;
+	}
+	unsigned char *out1 = NULL;
+	if (!pipelined && opt.scale == 1)
+	{
+		out1 = reserve(&(*ctx).out1, &(*ctx).out1Capacity, out1Size);
+		if (!out1)
+		{
+			makeError(&ans, "Not enough memory for decoded data\n", ERROR_OUT_OF_MEMORY);
+			return ans;
+		}
+		t = stageStart();
+		if (opt.preview > 0)
+		{
+			ret = inf(&(*ctx).infl, &buf, out1, rawSize, PARTIAL_INFLATE);
+		}
+		else
+		{
+			out1 = paddedBase(out1);
+			ret = inflatePadded(&(*ctx).infl, buf, out1, par, type);
+		}
+		stageEnd(STAGE_INFLATE, t, buf.size, rawSize);
+		if (ret != SUCCESS)
+		{
+			return rawError(ret == ERROR_OUT_OF_MEMORY ? -5 : -4);
+		}
+	}
+	if (fused)
+	{
+		f = openOutput(output);
+		if (!f)
+		{
+			makeError(&ans, "Cannot open output file\n", ERROR_CANNOT_OPEN_FILE);
+			return ans;
+		}
+		int asP5 = 1;
+		ret = writePallet(f, par, out1, buf, &asP5);
+		ret = closeOutput(output, f) != 0 && ret == 0 ? -6 : ret;
+		if (ret != 0)
+		{
+			discardOutput(output);
+			return rawError(ret);
+		}
+		return ans;
+	}
+	if (direct)
+	{
+		f = openOutput(output);
+		if (!f)
+		{
+			makeError(&ans, "Cannot open output file\n", ERROR_CANNOT_OPEN_FILE);
+			return ans;
+		}
+		int asP5 = 1;
+		ret = pipelineRaw(type, par, NULL, buf, &asP5, &(*ctx).infl, f);
+		ret = closeOutput(output, f) != 0 && ret == 0 ? -6 : ret;
+		if (ret != 0)
+		{
+			discardOutput(output);
+			return rawError(ret);
+		}
+		return ans;
+	}
+	char header[32];
+	int headerSize = snprintf(header, sizeof(header), "P6\n%i %i\n255\n", outPar[0], outPar[1]);
+	unsigned char *out2;
+	if ((*output).memory != NULL)
+	{
+		// P5 and P6 headers have the same length, so pixels are decoded right after it
+		if (headerSize + out2Size > (*output).capacity)
+		{
+			makeError(&ans, "Output slot is too small for the image\n", ERROR_PARAMETER_INVALID);
+			return ans;
+		}
+		out2 = (*output).memory + headerSize;
+	}
+	else
+	{
+		out2 = reserve(&(*ctx).out2, &(*ctx).out2Capacity, out2Size);
+	}
+	if (!out2)
+	{
+		makeError(&ans, "Not enough memory for decoded data\n", ERROR_OUT_OF_MEMORY);
+		return ans;
+	}
+	int asP5 = 1;
+	t = stageStart();
+	if (opt.preview > 0)
+	{
+		ret = previewRaw(type, par, out2, out1, buf, &asP5, opt.preview);
+		stageEnd(STAGE_UNFILTER, t, rawSize, outSize * (asP5 ? 1 : 3));
+	}
+	else if (opt.scale > 1)
+	{
+		ret = scaleRaw(type, par, out2, buf, &asP5, opt.scale, &(*ctx).infl);
+	}
+	else if (pipelined)
+	{
+		ret = pipelineRaw(type, par, out2, buf, &asP5, &(*ctx).infl, NULL);
+	}
+	else
+	{
+		ret = convertRaw(size, type, par, out2, out1, buf, &asP5, !banded);
+	}
+	if (ret != 0)
+	{
+		return rawError(ret);
+	}
+	if ((*output).memory != NULL)
+	{
+		header[1] = asP5 ? '5' : '6';
+		memcpy((*output).memory, header, headerSize);
+		(*output).size = headerSize + outSize * (asP5 ? 1 : 3);
+		return ans;
+	}
+	t = stageStart();
+	f = openOutput(output);
+	if (!f)
+	{
+		makeError(&ans, "Cannot open output file\n", ERROR_CANNOT_OPEN_FILE);
+		return ans;
+	}
+	if (banded)
+	{
+		ret = writeBands(f, out2, buf, asP5, outPar, bands, opt.useMap);
+	}
+	else
+	{
+		ret = writeToFile(f, out2, buf, asP5, outSize, type, outPar);
+	}
+	ret = closeOutput(output, f) != 0 && ret == 0 ? -6 : ret;
+	stageEnd(STAGE_WRITE, t, outSize * (asP5 ? 1 : 3), headerSize + outSize * (asP5 ? 1 : 3));
+	if (ret != 0)
+	{
+		discardOutput(output);
+		if (ret == -3)
+		{
+			makeError(&ans, "Not enough memory for output rows\n", ERROR_OUT_OF_MEMORY);
+			return ans;
+		}
+		return rawError(ret);
+	}
+	return ans;
+}
+// Converts the PNG read from f (closed here) into a PNM at output, or takes it from --cache when it was converted
+// before
+struct pair convert(FILE *f, struct output *output, struct options opt, struct context *ctx)
+{
+	(*output).cached = CACHE_UNUSED;
+	struct pair ans = decode(f, output, opt, ctx);
+	if (ans.returnCode == SUCCESS && (*output).cached == CACHE_MISS)
+	{
+		struct mark t = stageStart();
+		cacheStore(conversionCache, output);
+		stageEnd(STAGE_CACHE, t, 0, 0);
+	}
+	return ans;
+}
+#if !defined(_WIN32)
+// Sends the whole buffer, returns -1 once the client is gone
+int sendAll(int fd, const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t sent = send(fd, data, size, 0);
+		if (sent <= 0)
+		{
+			return -1;
+		}
+		data += sent;
+		size -= sent;
+	}
+	return 0;
+}
+#	define SHM_SLOTS 64
+// Request descriptor in shared memory, the client owns it in state 0 and 2, the server in state 1
+struct shmRequest
+{
+	atomic_int state;
+	int returnCode;
+	unsigned long long input;
+	unsigned long long inputSize;
+	unsigned long long output;
+	unsigned long long outputCapacity;
+	unsigned long long outputSize;
+};
+// Start of the shared region, offsets in requests are relative to it and point past this header. sleeping is set
+// while the server waits on the doorbell
+struct shmRing
+{
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_int sleeping;
+	struct shmRequest requests[SHM_SLOTS];
+};
+// Sends text with the descriptors fds attached
+int sendDescriptors(int fd, const int fds[], int count, const char *text, size_t size)
+{
+	struct iovec iov = { (void *)text, size };
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	return sendmsg(fd, &msg, 0) == (ssize_t)size ? 0 : -1;
+}
+// Hands the client a memfd holding a struct shmRing followed by size bytes for PNG inputs and PNM output slots, and
+// an eventfd as doorbell. The client fills a free descriptor at head (state 1) and writes to the doorbell if the
+// server is sleeping, the server decodes straight from and into the region and sets state 2, the client frees it
+// again with state 0. The connection stays open only to notice the client leaving.
+void serveShared(int fd, size_t size, struct options opt, struct context *ctx)
+{
+#	if defined(__linux__)
+	size_t total = sizeof(struct shmRing) + size;
+	int shared = memfd_create("png2pnm", MFD_CLOEXEC);
+	int bell = eventfd(0, EFD_CLOEXEC);
+	struct shmRing *ring = NULL;
+	if (shared >= 0 && bell >= 0 && ftruncate(shared, total) == 0)
+	{
+		ring = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, shared, 0);
+	}
+	if (ring == NULL || ring == MAP_FAILED)
+	{
+		if (shared >= 0)
+		{
+			close(shared);
+		}
+		if (bell >= 0)
+		{
+			close(bell);
+		}
+		char *text = "2\tCannot create shared memory\n";
+		sendAll(fd, text, strlen(text));
+		return;
+	}
+	char response[64];
+	int length = snprintf(response, sizeof(response), "0\t%zu\n", sizeof(struct shmRing));
+	int fds[2] = { shared, bell };
+	int ret = sendDescriptors(fd, fds, 2, response, length);
+	close(shared);
+	unsigned char *base = (unsigned char *)ring;
+	while (ret == 0)
+	{
+		unsigned int tail = atomic_load_explicit(&(*ring).tail, memory_order_relaxed);
+		struct shmRequest *req = &(*ring).requests[tail % SHM_SLOTS];
+		if (atomic_load_explicit(&(*req).state, memory_order_acquire) != 1)
+		{
+			// Nothing queued. The request is checked again after announcing the sleep, so one published before
+			// the client saw sleeping set cannot be missed
+			atomic_store(&(*ring).sleeping, 1);
+			if (atomic_load(&(*req).state) != 1)
+			{
+				struct pollfd p[2] = { { fd, POLLIN, 0 }, { bell, POLLIN, 0 } };
+				char c;
+				if (poll(p, 2, -1) < 0 && errno != EINTR)
+				{
+					break;
+				}
+				if ((p[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0 && recv(fd, &c, 1, 0) <= 0)
+				{
+					break;
+				}
+				uint64_t rings;
+				if ((p[1].revents & POLLIN) != 0 && read(bell, &rings, sizeof(rings)) < 0)
+				{
+					break;
+				}
+			}
+			atomic_store(&(*ring).sleeping, 0);
+			continue;
+		}
+		// The client can still write the descriptor, so it is read once and only the copy is checked and used
+		const volatile struct shmRequest *shown = req;
+		unsigned long long input = (*shown).input;
+		unsigned long long inputSize = (*shown).inputSize;
+		unsigned long long output = (*shown).output;
+		unsigned long long outputCapacity = (*shown).outputCapacity;
+		struct pair r = { 0, SUCCESS };
+		struct output out = { 0 };
+		if (input < sizeof(struct shmRing) || output < sizeof(struct shmRing) || input > total ||
+			inputSize > total - input || output > total || outputCapacity > total - output)
+		{
+			makeError(&r, "Request is outside of shared memory\n", ERROR_PARAMETER_INVALID);
+		}
+		else
+		{
+			FILE *f = fmemopen(base + input, inputSize, "rb");
+			out.memory = base + output;
+			out.capacity = outputCapacity;
+			if (f == NULL)
+			{
+				makeError(&r, "Not enough memory for input stream\n", ERROR_OUT_OF_MEMORY);
+			}
+			else
+			{
+				(*ctx).source = base + input;
+				r = convert(f, &out, opt, ctx);
+				(*ctx).source = NULL;
+			}
+		}
+		(*req).returnCode = r.returnCode;
+		(*req).outputSize = r.returnCode == SUCCESS ? out.size : 0;
+		atomic_store_explicit(&(*ring).tail, tail + 1, memory_order_relaxed);
+		atomic_store_explicit(&(*req).state, 2, memory_order_release);
+	}
+	close(bell);
+	munmap(ring, total);
+#	else
+	char *text = "5\tShared memory transport needs memfd\n";
+	sendAll(fd, text, strlen(text));
+#	endif
+}
+// Serves requests of one client until it disconnects:
+//   FILE <input>\t<output>\n              converts a file
+//   DATA <size>\t<output>\n<size bytes>   converts PNG bytes sent inline
+//   SHM <size>\n                          switches the connection to a shared memory ring, see serveShared
+// and answers each with <return code>\t<message>\n
+void serveClient(int fd, struct options opt, struct context *ctx)
+{
+	FILE *in = fdopen(fd, "rb");
+	if (in == NULL)
+	{
+		close(fd);
+		return;
+	}
+	char line[8192];
+	char response[256];
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		struct pair r = { 0, SUCCESS };
+		char *tab = strchr(line, '\t');
+		char *end = strchr(line, '\n');
+		if ((tab == NULL || end == NULL) && strncmp(line, "SHM ", 4) != 0)
+		{
+			makeError(&r, "Expected FILE or DATA request\n", ERROR_PARAMETER_INVALID);
+		}
+		else if (strncmp(line, "FILE ", 5) == 0)
+		{
+			*tab = '\0';
+			*end = '\0';
+			FILE *f = fopen(line + 5, "rb");
+			if (f == NULL)
+			{
+				makeError(&r, "Cannot open input file\n", ERROR_CANNOT_OPEN_FILE);
+			}
+			else
+			{
+				struct output out = { .path = tab + 1 };
+				r = convert(f, &out, opt, ctx);
+			}
+		}
+		else if (strncmp(line, "DATA ", 5) == 0)
+		{
+			*tab = '\0';
+			*end = '\0';
+			size_t size = strtoull(line + 5, NULL, 10);
+			// Checked before anything is allocated, the payload that follows cannot be skipped so the connection ends
+			if (size > (opt.maxMemory > 0 ? opt.maxMemory : opt.maxBytes))
+			{
+				int length = snprintf(response,
+									  sizeof(response),
+									  "%i\tInput exceeds the memory budget\n",
+									  ERROR_PARAMETER_INVALID);
+				sendAll(fd, response, length);
+				break;
+			}
+			unsigned char *data = reserve(&(*ctx).input, &(*ctx).inputCapacity, size);
+			if (data == NULL)
+			{
+				int length = snprintf(response,
+									  sizeof(response),
+									  "%i\tNot enough memory for input\n",
+									  ERROR_OUT_OF_MEMORY);
+				sendAll(fd, response, length);
+				break;
+			}
+			if (fread(data, 1, size, in) != size)
+			{
+				break;
+			}
+			FILE *f = fmemopen(data, size, "rb");
+			if (f == NULL)
+			{
+				makeError(&r, "Not enough memory for input stream\n", ERROR_OUT_OF_MEMORY);
+			}
+			else
+			{
+				struct output out = { .path = tab + 1 };
+				(*ctx).source = data;
+				r = convert(f, &out, opt, ctx);
+				(*ctx).source = NULL;
+			}
+		}
+		else if (strncmp(line, "SHM ", 4) == 0 && end != NULL)
+		{
+			*end = '\0';
+			serveShared(fd, strtoull(line + 4, NULL, 10), opt, ctx);
+			break;
+		}
+		else
+		{
+			makeError(&r, "Expected FILE or DATA request\n", ERROR_PARAMETER_INVALID);
+		}
+		int length = snprintf(response, sizeof(response), "%i\t%s", r.returnCode, r.text != NULL ? r.text : "\n");
+		if (sendAll(fd, response, length) != 0)
+		{
+			break;
+		}
+	}
+	fclose(in);
+}
+struct worker
+{
+	int listener;
+	struct options opt;
+	thread_t id;
+};
+void *serveWorker(void *arg)
+{
+	struct worker *w = arg;
+	struct context ctx = { 0 };
+	while (1)
+	{
+		int fd = accept((*w).listener, NULL, NULL);
+		if (fd >= 0)
+		{
+			serveClient(fd, (*w).opt, &ctx);
+		}
+		else if (errno != EINTR && errno != ECONNABORTED)
+		{
+			break;
+		}
+	}
+	contextFree(&ctx);
+	return NULL;
+}
+#endif
+// Accepts conversions over a Unix domain socket on pre-started workers that keep their buffers between requests
+int serve(struct options opt)
+{
+#if defined(_WIN32)
+	fprintf(stderr, "Daemon mode needs Unix domain sockets\n");
+	return ERROR_UNSUPPORTED;
+#else
+	struct sockaddr_un addr = { 0 };
+	if (strlen(opt.daemon) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path is too long\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, opt.daemon);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		fprintf(stderr, "Cannot create socket\n");
+		return ERROR_UNKNOWN;
+	}
+	unlink(opt.daemon);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0)
+	{
+		close(listener);
+		fprintf(stderr, "Cannot listen on socket\n");
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	struct worker *workers = calloc(opt.threads, sizeof(struct worker));
+	if (workers == NULL)
+	{
+		close(listener);
+		fprintf(stderr, "Not enough memory for workers\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	int started = 0;
+	for (int t = 0; t < opt.threads; t++)
+	{
+		workers[t].listener = listener;
+		workers[t].opt = opt;
+		// Requests run side by side, so each conversion stays on its worker
+		workers[t].opt.threads = 1;
+		if (t > 0 && threadCreate(&workers[t].id, serveWorker, &workers[t]) == 0)
+		{
+			started++;
+		}
+	}
+	serveWorker(&workers[0]);
+	close(listener);
+	for (int t = 1; t <= started; t++)
+	{
+		threadJoin(workers[t].id);
+	}
+	free(workers);
+	unlink(opt.daemon);
+	return SUCCESS;
+#endif
+}
+// A file read or written by the batch I/O thread
+struct ioFile
+{
+	int fd;
+	unsigned char *data;
+	size_t size;
+	size_t done;
+};
+struct job
+{
+	char *input;
+	char *output;
+	struct pair result;
+	double seconds;
+	// Estimated from the IHDR and the file size before the batch starts
+	unsigned long long cost;
+	size_t pixels;
+	struct stats stats;
+	// Open input and output of a stream, NULL for files
+	FILE *source;
+	FILE *sink;
+	// The input read ahead and the output written behind by the batch I/O thread
+	atomic_int inputState;
+	struct ioFile in;
+	struct ioFile out;
+	struct job *next;
+};
+void probeJob(struct job *job)
+{
+	FILE *f = fopen((*job).input, "rb");
+	if (!f)
+	{
+		return;
+	}
+	unsigned char head[26];
+	size_t got = fread(head, 1, sizeof(head), f);
+	size_t compressed = remainingBytes(f);
+	fclose(f);
+	if (got < sizeof(head))
+	{
+		return;
+	}
+	unsigned long long width = 0;
+	unsigned long long height = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		width = width << 8 | head[16 + i];
+		height = height << 8 | head[20 + i];
+	}
+	if (width > 0x7FFFFFFF || height > 0x7FFFFFFF)
+	{
+		return;
+	}
+	// Inflating one compressed byte costs about as much as writing a few output bytes
+	(*job).cost = width * height * (head[25] == 0 ? 1 : 3) + 4ULL * compressed;
+	(*job).pixels = width * height;
+}
+enum inputState
+{
+	INPUT_IDLE,
+	INPUT_READING,
+	INPUT_READY,
+	// Opened by the worker itself: not read ahead, too large or the read failed
+	INPUT_WORKER
+};
+#if defined(__linux__)
+// Batch I/O on io_uring through raw syscalls. One I/O thread is the only user of the ring: it opens and reads inputs
+// ahead of the workers in the order they will take them, and writes the outputs of small images behind them, so
+// the workers do not wait for storage. A read of an eventfd stays queued to wake the thread when work arrives
+#	define IO_ENTRIES 64
+#	define IO_AHEAD 32
+#	define IO_AHEAD_BYTES ((size_t)64 << 20)
+struct batchIo
+{
+	int ring;
+	void *maps[3];
+	size_t mapSizes[3];
+	atomic_uint *sqTail;
+	atomic_uint *sqHead;
+	unsigned sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	atomic_uint *cqTail;
+	atomic_uint *cqHead;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	// Entries prepared but not submitted, and entries not completed yet
+	unsigned submit;
+	unsigned inFlight;
+	int wake;
+	int armed;
+	unsigned long long wakeValue;
+	// Inputs in the order the workers take them, and how many are read ahead but not taken
+	struct job **ahead;
+	int aheadCount;
+	int nextAhead;
+	atomic_int buffered;
+	atomic_ullong bufferedBytes;
+	// Outputs handed over by the workers, the ones waiting for a free entry and the bytes they hold
+	_Atomic(struct job *) writes;
+	struct job *waiting;
+	atomic_ullong writeBytes;
+	atomic_int stop;
+};
+static struct batchIo *batchIo;
+void ioWake(struct batchIo *io)
+{
+	unsigned long long one = 1;
+	if (write((*io).wake, &one, sizeof(one)) < 0)
+	{
+		// The counter only saturates when the thread is already due to wake up
+	}
+}
+struct io_uring_sqe *ioSqe(struct batchIo *io, uintptr_t data)
+{
+	unsigned tail = atomic_load_explicit((*io).sqTail, memory_order_relaxed);
+	unsigned index = tail & (*io).sqMask;
+	struct io_uring_sqe *sqe = &(*io).sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	(*sqe).user_data = data;
+	(*io).sqArray[index] = index;
+	atomic_store_explicit((*io).sqTail, tail + 1, memory_order_release);
+	(*io).submit++;
+	(*io).inFlight++;
+	return sqe;
+}
+int ioEnter(struct batchIo *io, unsigned wait)
+{
+	for (;;)
+	{
+		unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+		long ret = syscall(SYS_io_uring_enter, (*io).ring, (*io).submit, wait, flags, NULL, 0);
+		if (ret >= 0)
+		{
+			(*io).submit -= ret;
+			return 0;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			return -1;
+		}
+	}
+}
+void ioReadWrite(struct batchIo *io, struct ioFile *file, uintptr_t data, int opcode)
+{
+	struct io_uring_sqe *sqe = ioSqe(io, data);
+	size_t left = (*file).size - (*file).done;
+	(*sqe).opcode = opcode;
+	(*sqe).fd = (*file).fd;
+	(*sqe).addr = (uintptr_t)((*file).data + (*file).done);
+	(*sqe).len = left > (1u << 30) ? (1u << 30) : (unsigned)left;
+	(*sqe).off = (*file).done;
+}
+void ioOpen(struct batchIo *io, const char *path, int flags, uintptr_t data)
+{
+	struct io_uring_sqe *sqe = ioSqe(io, data);
+	(*sqe).opcode = IORING_OP_OPENAT;
+	(*sqe).fd = AT_FDCWD;
+	(*sqe).addr = (uintptr_t)path;
+	(*sqe).open_flags = flags | O_CLOEXEC;
+	(*sqe).len = 0666;
+}
+void ioInputEnd(struct batchIo *io, struct job *job, int state)
+{
+	if ((*job).in.fd >= 0)
+	{
+		close((*job).in.fd);
+		(*job).in.fd = -1;
+	}
+	if (state == INPUT_WORKER)
+	{
+		atomic_fetch_sub(&(*io).bufferedBytes, (*job).in.size);
+		atomic_fetch_sub(&(*io).buffered, 1);
+		release((*job).in.data);
+		(*job).in.data = NULL;
+	}
+	atomic_store(&(*job).inputState, state);
+	parkNotify(&poolParking);
+}
+void ioInputDone(struct batchIo *io, struct job *job, int res)
+{
+	struct ioFile *in = &(*job).in;
+	struct stat st;
+	if ((*in).fd < 0)
+	{
+		(*in).fd = res;
+		int usable = res >= 0 && fstat(res, &st) == 0 && st.st_size > 0 && (size_t)st.st_size <= IO_AHEAD_BYTES;
+		(*in).data = usable ? allocate(st.st_size) : NULL;
+		if ((*in).data == NULL)
+		{
+			ioInputEnd(io, job, INPUT_WORKER);
+			return;
+		}
+		(*in).size = st.st_size;
+		(*in).done = 0;
+		atomic_fetch_add(&(*io).bufferedBytes, (*in).size);
+	}
+	else if (res < 0 || (res == 0 && (*in).done == 0))
+	{
+		ioInputEnd(io, job, INPUT_WORKER);
+		return;
+	}
+	else
+	{
+		// A file that shrank since fstat ends early
+		(*in).done += res;
+		(*in).size = res == 0 ? (*in).done : (*in).size;
+	}
+	if ((*in).done < (*in).size)
+	{
+		ioReadWrite(io, in, (uintptr_t)job, IORING_OP_READ);
+		return;
+	}
+	ioInputEnd(io, job, INPUT_READY);
+}
+void ioOutputEnd(struct batchIo *io, struct job *job, int ret)
+{
+	if ((*job).out.fd >= 0 && close((*job).out.fd) != 0 && ret == 0)
+	{
+		ret = -6;
+	}
+	if ((*job).out.fd >= 0 && ret != 0)
+	{
+		remove((*job).output);
+	}
+	if (ret != 0)
+	{
+		(*job).result = rawError(ret);
+	}
+	(*job).out.fd = -1;
+	atomic_fetch_sub(&(*io).writeBytes, (*job).out.size);
+	release((*job).out.data);
+	(*job).out.data = NULL;
+}
+void ioOutputDone(struct batchIo *io, struct job *job, int res)
+{
+	struct ioFile *out = &(*job).out;
+	if ((*out).fd < 0 && res < 0)
+	{
+		makeError(&(*job).result, "Cannot open output file\n", ERROR_CANNOT_OPEN_FILE);
+		ioOutputEnd(io, job, 0);
+		return;
+	}
+	if ((*out).fd < 0)
+	{
+		(*out).fd = res;
+	}
+	else if (res <= 0)
+	{
+		ioOutputEnd(io, job, -6);
+		return;
+	}
+	else
+	{
+		(*out).done += res;
+	}
+	if ((*out).done < (*out).size)
+	{
+		ioReadWrite(io, out, (uintptr_t)job | 1, IORING_OP_WRITE);
+		return;
+	}
+	ioOutputEnd(io, job, 0);
+}
+// Completions carry the job, with the low bit set for outputs, or 0 for the wake-up read
+void ioReap(struct batchIo *io)
+{
+	unsigned head = atomic_load_explicit((*io).cqHead, memory_order_relaxed);
+	while (head != atomic_load_explicit((*io).cqTail, memory_order_acquire))
+	{
+		struct io_uring_cqe cqe = (*io).cqes[head & (*io).cqMask];
+		atomic_store_explicit((*io).cqHead, ++head, memory_order_release);
+		(*io).inFlight--;
+		if (cqe.user_data == 0)
+		{
+			(*io).armed = 0;
+		}
+		else if (cqe.user_data & 1)
+		{
+			ioOutputDone(io, (struct job *)(uintptr_t)(cqe.user_data - 1), cqe.res);
+		}
+		else
+		{
+			ioInputDone(io, (struct job *)(uintptr_t)cqe.user_data, cqe.res);
+		}
+	}
+}
+// Queues new work while entries are free, one is always kept for the wake-up read
+void ioStart(struct batchIo *io)
+{
+	if (!(*io).armed)
+	{
+		struct io_uring_sqe *sqe = ioSqe(io, 0);
+		(*sqe).opcode = IORING_OP_READ;
+		(*sqe).fd = (*io).wake;
+		(*sqe).addr = (uintptr_t)&(*io).wakeValue;
+		(*sqe).len = sizeof((*io).wakeValue);
+		(*io).armed = 1;
+	}
+	struct job *writes = atomic_exchange(&(*io).writes, NULL);
+	while (writes != NULL)
+	{
+		struct job *next = (*writes).next;
+		(*writes).next = (*io).waiting;
+		(*io).waiting = writes;
+		writes = next;
+	}
+	while ((*io).waiting != NULL && (*io).inFlight < IO_ENTRIES)
+	{
+		struct job *job = (*io).waiting;
+		(*io).waiting = (*job).next;
+		ioOpen(io, (*job).output, O_WRONLY | O_CREAT | O_TRUNC, (uintptr_t)job | 1);
+	}
+	while ((*io).nextAhead < (*io).aheadCount && (*io).inFlight < IO_ENTRIES && !atomic_load(&(*io).stop) &&
+		   atomic_load(&(*io).buffered) < IO_AHEAD && atomic_load(&(*io).bufferedBytes) < IO_AHEAD_BYTES)
+	{
+		struct job *job = (*io).ahead[(*io).nextAhead++];
+		int state = INPUT_IDLE;
+		if (atomic_compare_exchange_strong(&(*job).inputState, &state, INPUT_READING))
+		{
+			atomic_fetch_add(&(*io).buffered, 1);
+			ioOpen(io, (*job).input, O_RDONLY, (uintptr_t)job);
+		}
+	}
+}
+void *ioStage(void *arg)
+{
+	struct batchIo *io = arg;
+	for (;;)
+	{
+		ioStart(io);
+		int idle = (*io).inFlight == (unsigned)(*io).armed && (*io).waiting == NULL;
+		if (idle && atomic_load(&(*io).stop) && atomic_load(&(*io).writes) == NULL)
+		{
+			break;
+		}
+		if (ioEnter(io, 1) != 0)
+		{
+			break;
+		}
+		ioReap(io);
+	}
+	return NULL;
+}
+void *ioMap(struct batchIo *io, int i, size_t size, long long offset)
+{
+	(*io).mapSizes[i] = size;
+	(*io).maps[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, (*io).ring, offset);
+	return (*io).maps[i] == MAP_FAILED ? NULL : (*io).maps[i];
+}
+void ioFree(struct batchIo *io)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		if ((*io).maps[i] != NULL && (*io).maps[i] != MAP_FAILED)
+		{
+			munmap((*io).maps[i], (*io).mapSizes[i]);
+		}
+	}
+	if ((*io).wake >= 0)
+	{
+		close((*io).wake);
+	}
+	if ((*io).ring >= 0)
+	{
+		close((*io).ring);
+	}
+	free((*io).ahead);
+}
+// Sets up the ring, returns -1 when io_uring is not available (old kernel, seccomp, RLIMIT_MEMLOCK)
+int ioInit(struct batchIo *io, struct job **ahead, int count)
+{
+	struct io_uring_params p = { 0 };
+	memset(io, 0, sizeof(*io));
+	(*io).ahead = ahead;
+	(*io).aheadCount = count;
+	(*io).wake = eventfd(0, EFD_CLOEXEC);
+	(*io).ring = syscall(SYS_io_uring_setup, IO_ENTRIES, &p);
+	if (ahead == NULL || (*io).wake < 0 || (*io).ring < 0)
+	{
+		ioFree(io);
+		return -1;
+	}
+	size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	unsigned char *sq = ioMap(io, 0, sqSize, IORING_OFF_SQ_RING);
+	unsigned char *cq = ioMap(io, 1, cqSize, IORING_OFF_CQ_RING);
+	(*io).sqes = ioMap(io, 2, p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+	if (sq == NULL || cq == NULL || (*io).sqes == NULL)
+	{
+		ioFree(io);
+		return -1;
+	}
+	(*io).sqTail = (atomic_uint *)(sq + p.sq_off.tail);
+	(*io).sqHead = (atomic_uint *)(sq + p.sq_off.head);
+	(*io).sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	(*io).sqArray = (unsigned *)(sq + p.sq_off.array);
+	(*io).cqTail = (atomic_uint *)(cq + p.cq_off.tail);
+	(*io).cqHead = (atomic_uint *)(cq + p.cq_off.head);
+	(*io).cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	(*io).cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	atomic_init(&(*io).buffered, 0);
+	atomic_init(&(*io).bufferedBytes, 0);
+	atomic_init(&(*io).writes, NULL);
+	atomic_init(&(*io).writeBytes, 0);
+	atomic_init(&(*io).stop, 0);
+	return 0;
+}
+// Opens the input of job, from memory when the I/O thread has read it, and waits while the read is in flight
+FILE *ioOpenInput(struct job *job)
+{
+	int state = INPUT_IDLE;
+	if (batchIo == NULL || atomic_compare_exchange_strong(&(*job).inputState, &state, INPUT_WORKER))
+	{
+		return fopen((*job).input, "rb");
+	}
+	while ((state = atomic_load(&(*job).inputState)) == INPUT_READING)
+	{
+		unsigned int ticket = parkTicket(&poolParking);
+		if (atomic_load(&(*job).inputState) == INPUT_READING)
+		{
+			parkWait(&poolParking, ticket);
+		}
+		else
+		{
+			parkCancel(&poolParking);
+		}
+	}
+	return state == INPUT_READY ? fmemopen((*job).in.data, (*job).in.size, "rb") : fopen((*job).input, "rb");
+}
+// The input of job when ioOpenInput gave a stream over the bytes read ahead, NULL otherwise
+const unsigned char *ioInputData(struct job *job)
+{
+	return batchIo != NULL && atomic_load(&(*job).inputState) == INPUT_READY ? (*job).in.data : NULL;
+}
+void ioReleaseInput(struct job *job)
+{
+	if (batchIo != NULL && atomic_load(&(*job).inputState) == INPUT_READY)
+	{
+		release((*job).in.data);
+		(*job).in.data = NULL;
+		atomic_fetch_sub(&(*batchIo).bufferedBytes, (*job).in.size);
+		atomic_fetch_sub(&(*batchIo).buffered, 1);
+		ioWake(batchIo);
+	}
+}
+// A buffer for the whole PNM when the I/O thread can write it behind, NULL to write the file directly. Large images
+// keep their band writes, and the outputs waiting for the disk are bounded like the inputs read ahead. With --cache
+// outputs are written directly, so a hit clones or links its entry instead of copying it through memory
+unsigned char *ioOutputBuffer(struct job *job, struct options opt, size_t *capacity)
+{
+	size_t size = 32 + (*job).pixels * 3;
+	if (batchIo == NULL || opt.maxMemory > 0 || opt.cache != NULL || (*job).pixels == 0 ||
+		(*job).pixels * 3 >= POOL_BAND_BYTES || atomic_load(&(*batchIo).writeBytes) + size > IO_AHEAD_BYTES)
+	{
+		return NULL;
+	}
+	unsigned char *data = allocate(size);
+	if (data != NULL)
+	{
+		atomic_fetch_add(&(*batchIo).writeBytes, size);
+		*capacity = size;
+	}
+	return data;
+}
+void ioQueueOutput(struct job *job, struct output out, int ok)
+{
+	atomic_fetch_sub(&(*batchIo).writeBytes, out.capacity - (ok ? out.size : 0));
+	if (!ok)
+	{
+		release(out.memory);
+		return;
+	}
+	unshareOutput((*job).output);
+	(*job).out = (struct ioFile){ .fd = -1, .data = out.memory, .size = out.size };
+	(*job).next = atomic_load(&(*batchIo).writes);
+	while (!atomic_compare_exchange_weak(&(*batchIo).writes, &(*job).next, job))
+	{
+	}
+	ioWake(batchIo);
+}
+#else
+FILE *ioOpenInput(struct job *job)
+{
+	return fopen((*job).input, "rb");
+}
+const unsigned char *ioInputData(struct job *job)
+{
+	return NULL;
+}
+void ioReleaseInput(struct job *job) {}
+unsigned char *ioOutputBuffer(struct job *job, struct options opt, size_t *capacity)
+{
+	return NULL;
+}
+void ioQueueOutput(struct job *job, struct output out, int ok) {}
+#endif
+void runJob(struct job *job, struct options opt, struct context *ctx)
+{
+	threadStats = opt.stats || opt.trace != NULL ? &(*job).stats : NULL;
+	unsigned long long faults = pageFaults();
+	double start = now();
+	FILE *f = (*job).source != NULL ? (*job).source : ioOpenInput(job);
+	if (!f)
+	{
+		makeError(&(*job).result, "Cannot open input file\n", ERROR_CANNOT_OPEN_FILE);
+	}
+	else
+	{
+		struct output out = { .path = (*job).output, .stream = (*job).sink };
+		out.memory = ioOutputBuffer(job, opt, &out.capacity);
+		(*ctx).source = (*job).source != NULL ? NULL : ioInputData(job);
+		(*job).result = convert(f, &out, opt, ctx);
+		(*ctx).source = NULL;
+		if (out.memory != NULL)
+		{
+			ioQueueOutput(job, out, (*job).result.returnCode == SUCCESS);
+		}
+	}
+	ioReleaseInput(job);
+	double end = now();
+	(*job).seconds = end - start;
+	(*job).stats.pageFaults = pageFaults() - faults;
+	traceRecord(&(*job).stats, STAGES, start, end);
+	threadStats = NULL;
+}
+void printJsonString(FILE *f, const char *text)
+{
+	fputc('"', f);
+	for (; *text != '\0'; text++)
+	{
+		if (*text == '"' || *text == '\\')
+		{
+			fputc('\\', f);
+			fputc(*text, f);
+		}
+		else if ((unsigned char)*text < 0x20)
+		{
+			fprintf(f, "\\u%04x", (unsigned char)*text);
+		}
+		else
+		{
+			fputc(*text, f);
+		}
+	}
+	fputc('"', f);
+}
+double throughput(unsigned long long bytesIn, unsigned long long bytesOut, double seconds)
+{
+	unsigned long long bytes = bytesIn > bytesOut ? bytesIn : bytesOut;
+	return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+void printCounters(FILE *f, int available, const unsigned long long counters[])
+{
+	for (int i = 0; countersEnabled && available && i < COUNTERS; i++)
+	{
+		fprintf(f, ", \"%s\": %llu", counterNames[i], counters[i]);
+	}
+}
+void printJobStats(FILE *f, struct job *job)
+{
+	fprintf(f, "{\"input\": ");
+	printJsonString(f, (*job).input);
+	fprintf(f, ", \"output\": ");
+	printJsonString(f, (*job).output);
+	fprintf(f, ", \"returnCode\": %i, \"width\": %i, \"height\": %i, \"seconds\": %.9f, \"stages\": {",
+			(*job).result.returnCode,
+			(*job).stats.width,
+			(*job).stats.height,
+			(*job).seconds);
+	for (int i = 0; i < STAGES; i++)
+	{
+		struct stats *st = &(*job).stats;
+		fprintf(f, "%s\"%s\": {\"seconds\": %.9f, \"bytesIn\": %llu, \"bytesOut\": %llu, \"MBps\": %.3f",
+				i == 0 ? "" : ", ",
+				stageNames[i],
+				(*st).seconds[i],
+				(*st).bytesIn[i],
+				(*st).bytesOut[i],
+				throughput((*st).bytesIn[i], (*st).bytesOut[i], (*st).seconds[i]));
+		fprintf(f, ", \"allocations\": %llu, \"allocatedBytes\": %llu, \"peakBytes\": %llu",
+				(*st).allocations[i],
+				(*st).allocatedBytes[i],
+				(*st).peakBytes[i]);
+		printCounters(f, (*st).countersAvailable, (*st).counters[i]);
+		fprintf(f, "}");
+	}
+	fprintf(f, "}, \"peakBytes\": %llu, \"currentBytes\": %llu, \"pageFaults\": %llu",
+			atomic_load(&memoryPeak),
+			atomic_load(&memoryCurrent),
+			(*job).stats.pageFaults);
+	if ((*job).stats.cache != CACHE_UNUSED)
+	{
+		fprintf(f, ", \"cache\": \"%s\"", cacheNames[(*job).stats.cache]);
+	}
+	if (countersEnabled && !(*job).stats.countersAvailable)
+	{
+		fprintf(f, ", \"counters\": \"unavailable\"");
+	}
+	fprintf(f, "}\n");
+}
+int compareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+// Nearest-rank percentile of sorted values
+double percentile(const double *sorted, int count, double p)
+{
+	int rank = (int)(p * count + 0.999999);
+	return sorted[rank < 1 ? 0 : rank - 1];
+}
+void printPercentiles(FILE *f, double *values, int count)
+{
+	qsort(values, count, sizeof(double), compareDouble);
+	fprintf(f, "\"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f, \"max\": %.9f",
+			percentile(values, count, 0.5),
+			percentile(values, count, 0.9),
+			percentile(values, count, 0.99),
+			values[count - 1]);
+}
+void printBatchStats(FILE *f, struct job *jobs, int count, double seconds, unsigned long long faults)
+{
+	double *values = malloc(count * sizeof(double));
+	if (values == NULL)
+	{
+		return;
 	}
-	if (buf[4] != 0)
+	int failed = 0;
+	int countersAvailable = 0;
+	for (int j = 0; j < count; j++)
 	{
-		ans.text = "Only support images without interlace\n";
-		ans.returnCode = ERROR_UNSUPPORTED;
-		return ans;
+		failed += jobs[j].result.returnCode != SUCCESS;
+		countersAvailable |= jobs[j].stats.countersAvailable;
+		values[j] = jobs[j].seconds;
 	}
-	(*bu).type = buf[1];
-	if (buf[1] == 0 || buf[1] == 3)
+	fprintf(f, "{\"files\": %i, \"failed\": %i, \"seconds\": %.9f, \"perFile\": {", count, failed, seconds);
+	printPercentiles(f, values, count);
+	fprintf(f, "}, \"stages\": {");
+	for (int i = 0; i < STAGES; i++)
 	{
-		ans.type = 1;
-		ans.returnCode = SUCCESS;
-		return ans;
+		double total = 0;
+		unsigned long long bytesIn = 0;
+		unsigned long long bytesOut = 0;
+		unsigned long long counters[COUNTERS] = { 0 };
+		unsigned long long allocations = 0;
+		unsigned long long allocatedBytes = 0;
+		unsigned long long peakBytes = 0;
+		for (int j = 0; j < count; j++)
+		{
+			values[j] = jobs[j].stats.seconds[i];
+			total += values[j];
+			bytesIn += jobs[j].stats.bytesIn[i];
+			bytesOut += jobs[j].stats.bytesOut[i];
+			allocations += jobs[j].stats.allocations[i];
+			allocatedBytes += jobs[j].stats.allocatedBytes[i];
+			peakBytes = jobs[j].stats.peakBytes[i] > peakBytes ? jobs[j].stats.peakBytes[i] : peakBytes;
+			for (int k = 0; k < COUNTERS; k++)
+			{
+				counters[k] += jobs[j].stats.counters[i][k];
+			}
+		}
+		fprintf(f, "%s\"%s\": {", i == 0 ? "" : ", ", stageNames[i]);
+		printPercentiles(f, values, count);
+		fprintf(f, ", \"seconds\": %.9f, \"bytesIn\": %llu, \"bytesOut\": %llu, \"MBps\": %.3f",
+				total,
+				bytesIn,
+				bytesOut,
+				throughput(bytesIn, bytesOut, total));
+		fprintf(f, ", \"allocations\": %llu, \"allocatedBytes\": %llu, \"peakBytes\": %llu",
+				allocations,
+				allocatedBytes,
+				peakBytes);
+		printCounters(f, countersAvailable, counters);
+		fprintf(f, "}");
 	}
-	else if (buf[1] == 2)
+	fprintf(f, "}, \"peakBytes\": %llu, \"currentBytes\": %llu, \"pageFaults\": %llu",
+			atomic_load(&memoryPeak),
+			atomic_load(&memoryCurrent),
+			faults);
+	if (conversionCache != NULL)
 	{
-		ans.type = 3;
-		ans.returnCode = SUCCESS;
-		return ans;
+		unsigned long long hits = atomic_load(&(*conversionCache).hits);
+		unsigned long long misses = atomic_load(&(*conversionCache).misses);
+		fprintf(f,
+				", \"cache\": {\"hits\": %llu, \"misses\": %llu, \"hitRate\": %.3f, \"bytes\": %llu, "
+				"\"evicted\": %llu}",
+				hits,
+				misses,
+				hits + misses > 0 ? (double)hits / (hits + misses) : 0,
+				atomic_load(&(*conversionCache).bytes),
+				atomic_load(&(*conversionCache).evicted));
 	}
-	else
+	if (countersEnabled && !countersAvailable)
 	{
-		ans.text = "Only color types 0, 2, 3 are supported\n";
-		ans.returnCode = ERROR_UNSUPPORTED;
-		return ans;
+		fprintf(f, ", \"counters\": \"unavailable\"");
 	}
+	fprintf(f, "}\n");
+	free(values);
 }
-struct pair
-{
-	char *text;
-	int returnCode;
-};
-void makeError(struct pair *ans, char *text, int ret)
-{
-	(*ans).text = text;
-	(*ans).returnCode = ret;
-}
-struct pair parsePNG(FILE *f, struct image *buf)
+// Writes the recorded spans in the Chrome trace-event format and frees the thread buffers
+int writeTrace(const char *path)
 {
-	size_t ret;
-	struct pair ans;
-	int plte = 1;
-	int idat = 1;
-	unsigned char tmp[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	while (1)
+	FILE *f = fopen(path, "w");
+	int ret = f == NULL ? ERROR_CANNOT_OPEN_FILE : SUCCESS;
+	int first = 1;
+	if (f != NULL)
 	{
-		ans.returnCode = SUCCESS;
-		ret = fread(tmp, 1, 8, f);
-		if (ret != 8)
+		fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	}
+	struct traceBuffer *b = atomic_exchange(&traceBuffers, NULL);
+	while (b != NULL)
+	{
+		for (size_t i = 0; f != NULL && i < (*b).count; i++)
 		{
-			makeError(&ans, "Reached end of the file\n", ERROR_DATA_INVALID);
-			return ans;
+			struct traceEvent *e = &(*b).events[i];
+			const struct job *job = (const struct job *)((const char *)(*e).stats - offsetof(struct job, stats));
+			const struct stats *st = (*e).stats;
+			fprintf(f,
+					"%s\n{\"name\": \"%s\", \"cat\": \"%s\", ",
+					first ? "" : ",",
+					(*e).stage == STAGES ? "file" : stageNames[(*e).stage],
+					(*e).stage == STAGES ? "file" : "stage");
+			fprintf(f,
+					"\"ph\": \"X\", \"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"file\": ",
+					(*b).tid,
+					((*e).start - traceOrigin) * 1e6,
+					((*e).end - (*e).start) * 1e6);
+			printJsonString(f, (*job).input);
+			fprintf(f,
+					", \"bytes\": %llu, \"width\": %i, \"height\": %i}}",
+					(*st).bytesIn[STAGE_SIGNATURE] + (*st).bytesIn[STAGE_IHDR] + (*st).bytesIn[STAGE_CHUNKS],
+					(*st).width,
+					(*st).height);
+			first = 0;
 		}
-		size_t size = 0;
-		int umn = 1;
-		for (int i = 0; i < 4; i++)
+		if (f != NULL && (*b).dropped > 0)
 		{
-			size += (tmp[3 - i] & 0xFF) * umn;
-			umn *= (16 * 16);
+			fprintf(f,
+					"%s\n{\"name\": \"dropped\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %i, ",
+					first ? "" : ",",
+					(*b).tid);
+			fprintf(f, "\"ts\": 0, \"args\": {\"events\": %zu}}", (*b).dropped);
+			first = 0;
 		}
-		unsigned char *temp = malloc(sizeof(unsigned char) * size);
-		if (!temp)
+		struct traceBuffer *next = (*b).next;
+		free((*b).events);
+		free(b);
+		b = next;
+	}
+	if (f != NULL)
+	{
+		fprintf(f, "\n]}\n");
+		ret = ferror(f) ? ERROR_UNKNOWN : ret;
+		ret = fclose(f) != 0 ? ERROR_UNKNOWN : ret;
+	}
+	return ret;
+}
+// Work-stealing deque over a fixed slice of the job order, packed as first << 32 | end. Jobs are only taken, never
+// pushed, so the owner and the thieves each claim one with a single compare-and-swap
+struct deque
+{
+	atomic_ullong range;
+};
+// Takes the first job of the slice, or the last one when stealing, -1 when the slice is empty
+int dequeTake(struct deque *d, int steal)
+{
+	unsigned long long range = atomic_load(&(*d).range);
+	for (;;)
+	{
+		unsigned long long first = range >> 32;
+		unsigned long long end = range & 0xFFFFFFFF;
+		if (first >= end)
 		{
-			makeError(&ans, "Not enough memory for chunk data\n", ERROR_OUT_OF_MEMORY);
-			return ans;
+			return -1;
 		}
-		char name[8] = { tmp[4] & 0xFF, tmp[5] & 0xFF, tmp[6] & 0xFF, tmp[7] & 0xFF };
-		if (idat == 2 && strcmp(name, "IDAT") != 0)
+		unsigned long long next = steal ? first << 32 | (end - 1) : (first + 1) << 32 | end;
+		if (atomic_compare_exchange_weak(&(*d).range, &range, next))
 		{
-			idat = 0;
+			return (int)(steal ? end - 1 : first);
 		}
-		if (strcmp(name, "IDAT") == 0)
+	}
+}
+struct batch
+{
+	struct options opt;
+	struct job *jobs;
+	int count;
+	// Jobs grouped by worker, each group largest first
+	struct job **order;
+	struct deque *deques;
+	int workers;
+	atomic_int joined;
+	atomic_int finished;
+};
+void *batchWorker(void *arg)
+{
+	struct batch *b = arg;
+	struct context ctx = { 0 };
+	int self = atomic_fetch_add(&(*b).joined, 1);
+	poolSelf = self;
+	// Bands of the images being converted come first, and once no file is left the worker keeps taking bands until
+	// the last conversion is done
+	while (atomic_load(&(*b).finished) < (*b).count)
+	{
+		if (poolHelp() == 0)
 		{
-			plte = 0;
-			if (idat == 0)
-			{
-				free(temp);
-				makeError(&ans, "IDAT chunks must be in consecutive order", ERROR_DATA_INVALID);
-				return ans;
-			}
-			idat = 2;
-			unsigned char *t = realloc((*buf).data, ((*buf).size + size) * sizeof(char));
-			if (t == NULL)
-			{
-				free(temp);
-				makeError(&ans, "Not enough memory for new chunk\n", ERROR_OUT_OF_MEMORY);
-				return ans;
-			}
-			(*buf).data = t;
-			ret = fread(temp, 1, size, f);
-			if (ret != size)
-			{
-				free(temp);
-				makeError(&ans, "Wrong size of data in idat chunk\n", ERROR_DATA_INVALID);
-				return ans;
-			}
-			for (int i = 0; i < size; i++)
-			{
-				(*buf).data[(*buf).size + i] = temp[i];
-			}
-			(*buf).size += size;
+			continue;
 		}
-		else if (strcmp(name, "IEND") == 0)
+		int i = dequeTake(&(*b).deques[self], 0);
+		for (int v = 1; i < 0 && v < (*b).workers; v++)
 		{
-			ret = fread(tmp, 1, 5, f);
-			if (ret != 4)
-			{
-				free(temp);
-				makeError(&ans, "Wrong chunk after IEND\n", ERROR_DATA_INVALID);
-				return ans;
-			}
-			break;
+			i = dequeTake(&(*b).deques[(self + v) % (*b).workers], 1);
 		}
-		else if (strcmp(name, "PLTE") == 0)
+		if (i < 0)
 		{
-			if ((*buf).type == 0)
-			{
-				free(temp);
-				makeError(&ans, "Color type 0 don't expect plte chunk\n", ERROR_DATA_INVALID);
-				return ans;
-			}
-			if (plte == 0)
-			{
-				free(temp);
-				makeError(&ans, "Pallet chunk in wrong place\n", ERROR_DATA_INVALID);
-				return ans;
-			}
-			plte = 0;
-			(*buf).plteData = malloc(size);
-			(*buf).plteSize = size / 3;
-			if (!(*buf).plteData)
-			{
-				free(temp);
-				makeError(&ans, "Cannot alloc memory for pallet\n", ERROR_OUT_OF_MEMORY);
-				return ans;
-			}
-			ret = fread((*buf).plteData, 1, size, f);
-			if (ret != size)
+			// No file is left, so only a band pushed or the last conversion finishing can give the worker work
+			unsigned int ticket = parkTicket(&poolParking);
+			if (poolHelp() == 0 || atomic_load(&(*b).finished) >= (*b).count)
 			{
-				free(temp);
-				makeError(&ans, "Wrong plte chunk size\n", ERROR_DATA_INVALID);
-				return ans;
+				parkCancel(&poolParking);
 			}
-		}
-		else if (size == 0)
-		{
-			free(temp);
-			makeError(&ans, "Expected IEND chunk, found unsupported\n", ERROR_DATA_INVALID);
-			return ans;
-		}
-		else
-		{
-			ret = fread(temp, 1, size, f);
-			if (ret != size)
+			else
 			{
-				free(temp);
-				makeError(&ans, "Wrong chunk size\n", ERROR_DATA_INVALID);
-				return ans;
+				parkWait(&poolParking, ticket);
 			}
+			continue;
 		}
-		ret = fread(tmp, 1, 4, f);
-		if (ret != 4)
+		runJob((*b).order[i], (*b).opt, &ctx);
+		if (atomic_fetch_add(&(*b).finished, 1) + 1 == (*b).count)
 		{
-			free(temp);
-			makeError(&ans, "Wrong chunk hashcode size\n", ERROR_DATA_INVALID);
-			return ans;
+			parkNotify(&poolParking);
 		}
-		free(temp);
 	}
-	return ans;
+	poolSelf = -1;
+	contextFree(&ctx);
+	closeCounters();
+	return NULL;
 }
-int isGrayScale(unsigned char r, unsigned char g, unsigned char b)
+int compareCost(const void *a, const void *b)
 {
-	return r == g && g == b;
+	unsigned long long x = (**(struct job *const *)a).cost;
+	unsigned long long y = (**(struct job *const *)b).cost;
+	return (x < y) - (x > y);
 }
-
-void writeToFile(FILE *f, unsigned char *out2, struct image buf, int asP5, int size, int type, int par[])
+// Longest processing time first: jobs are sorted by estimated cost and each goes to the least loaded worker, so
+// the largest files start first and the stealing at the end only moves small ones
+int scheduleBatch(struct batch *b)
 {
-	if (buf.type == 2 || asP5 == 0)
+	int *owner = calloc((*b).count, sizeof(int));
+	unsigned long long *load = calloc((*b).workers, sizeof(unsigned long long));
+	struct job **sorted = calloc((*b).count, sizeof(struct job *));
+	if (owner == NULL || load == NULL || sorted == NULL)
 	{
-		fprintf(f, "P6\n");
-		fprintf(f, "%i %i\n", par[0], par[1]);
-		fprintf(f, "255\n");
-		fwrite(out2, 1, (size * type * ((buf.type == 3) * 3 + 1)), f);
+		free(owner);
+		free(load);
+		free(sorted);
+		return -1;
 	}
-	else if (buf.type == 0 || asP5 == 1)
+	for (int j = 0; j < (*b).count; j++)
 	{
-		fprintf(f, "P5\n");
-		fprintf(f, "%i %i\n", par[0], par[1]);
-		fprintf(f, "255\n");
-		fwrite(out2, 1, size * type, f);
+		probeJob(&(*b).jobs[j]);
+		(*b).order[j] = &(*b).jobs[j];
 	}
-}
-unsigned char applyFilter(unsigned char filter, unsigned char out1, unsigned char *out2, int plte, int par[], int cnt, int x, int type)
-{
-	if (filter == 0)
+	qsort((*b).order, (*b).count, sizeof(struct job *), compareCost);
+	for (int j = 0; j < (*b).count; j++)
 	{
-		return out1;
+		int w = 0;
+		for (int t = 1; t < (*b).workers; t++)
+		{
+			w = load[t] < load[w] ? t : w;
+		}
+		owner[j] = w;
+		load[w] += (*(*b).order[j]).cost + 1;
 	}
-	else if (filter == 1)
+	// Lays the groups out one after another, keeping the largest-first order inside each
+	int first = 0;
+	for (int t = 0; t < (*b).workers; t++)
 	{
-		if (cnt % par[0] != 0)
+		int end = first;
+		for (int j = 0; j < (*b).count; j++)
 		{
-			return (out1 + out2[x - type]) & 0xFF;
+			if (owner[j] == t)
+			{
+				sorted[end++] = (*b).order[j];
+			}
 		}
-		return out1 & 0xFF;
+		atomic_init(&(*b).deques[t].range, (unsigned long long)first << 32 | end);
+		first = end;
 	}
-	else if (filter == 2)
+	memcpy((*b).order, sorted, (*b).count * sizeof(struct job *));
+	free(owner);
+	free(load);
+	free(sorted);
+	return 0;
+}
+// Order in which the workers take their own jobs: the first job of every worker, then the second one and so on
+struct job **batchAhead(struct batch *b)
+{
+	struct job **ahead = calloc((*b).count, sizeof(struct job *));
+	int count = 0;
+	for (int k = 0; ahead != NULL && count < (*b).count; k++)
 	{
-		if (cnt / par[0] != 0)
+		for (int t = 0; t < (*b).workers; t++)
 		{
-			return (out1 + out2[x - (par[0] * type + plte)]) & 0xFF;
+			unsigned long long range = atomic_load(&(*b).deques[t].range);
+			if ((range >> 32) + k < (range & 0xFFFFFFFF))
+			{
+				ahead[count++] = (*b).order[(range >> 32) + k];
+			}
 		}
-		return out1;
 	}
-	else if (filter == 3)
+	return ahead;
+}
+// Converts every input/output pair with --threads workers, each conversion runs on one worker and large ones hand
+// their output bands to the others
+int runBatch(struct options opt)
+{
+	struct batch b = { .opt = opt, .count = opt.fileCount / 2 };
+	b.opt.threads = 1;
+	atomic_init(&b.joined, 0);
+	atomic_init(&b.finished, 0);
+	b.workers = opt.threads < b.count ? opt.threads : b.count;
+	b.jobs = calloc(b.count, sizeof(struct job));
+	b.order = calloc(b.count, sizeof(struct job *));
+	b.deques = calloc(b.workers, sizeof(struct deque));
+	poolDeques = calloc(b.workers, sizeof(struct taskDeque));
+	thread_t *ids = calloc(b.workers, sizeof(thread_t));
+	for (int j = 0; b.jobs != NULL && j < b.count; j++)
+	{
+		b.jobs[j].input = opt.files[2 * j];
+		b.jobs[j].output = opt.files[2 * j + 1];
+		b.jobs[j].in.fd = b.jobs[j].out.fd = -1;
+		atomic_init(&b.jobs[j].inputState, INPUT_IDLE);
+	}
+	int failed = b.jobs == NULL || b.order == NULL || b.deques == NULL || poolDeques == NULL || ids == NULL;
+	if (failed || scheduleBatch(&b) != 0)
 	{
-		int temp = (cnt % par[0] == 0 ? 0 : out2[x - type]) + (cnt / par[0] == 0 ? 0 : out2[x - (par[0] * type + plte)]);
-		temp /= 2;
-		return (out1 + temp) & 0xFF;
+		free(b.jobs);
+		free(b.order);
+		free(b.deques);
+		free(poolDeques);
+		poolDeques = NULL;
+		free(ids);
+		fprintf(stderr, "Not enough memory for batch\n");
+		return ERROR_OUT_OF_MEMORY;
 	}
-	else if (filter == 4)
+	for (int t = 0; t < b.workers; t++)
 	{
-		unsigned char a = (cnt % par[0] == 0 ? 0 : out2[x - type]) & 0xFF;
-		unsigned char b = (cnt / par[0] == 0 ? 0 : out2[x - (par[0] * type + plte)]) & 0xFF;
-		unsigned char c = (cnt % par[0] == 0 || cnt / par[0] == 0 ? 0 : out2[x - (par[0] * type + plte) - type]) & 0xFF;
-		int p = (a + b - c);
-		int ma = abs(p - a);
-		int mb = abs(p - b);
-		int mc = abs(p - c);
-		if (ma <= mb && ma <= mc)
-		{
-			return (out1 + a) & 0xFF;
-		}
-		else if (mb <= mc)
+		atomic_init(&poolDeques[t].top, 0);
+		atomic_init(&poolDeques[t].bottom, 0);
+	}
+	poolWorkers = b.workers;
+	parkInit(&poolParking);
+	unsigned long long faults = pageFaults();
+	double start = now();
+#if defined(__linux__)
+	struct batchIo io;
+	thread_t ioThread;
+	if (!opt.syncIo && ioInit(&io, batchAhead(&b), b.count) == 0)
+	{
+		if (threadCreate(&ioThread, ioStage, &io) == 0)
 		{
-			return (out1 + b) & 0xFF;
+			batchIo = &io;
 		}
 		else
 		{
-			return (out1 + c) & 0xFF;
+			ioFree(&io);
 		}
 	}
-	return 0;
-}
-int palletRaw(int size, int type, int par[], unsigned char *out2, unsigned char *out1, struct image buf, int *asP5)
-{
-	unsigned char filter;
-	int cnt = 0;
-	int x = 0;
-	for (int j = 0; j < par[1]; j++)
+#endif
+	int started = 0;
+	for (int t = 1; t < b.workers; t++)
 	{
-		filter = out1[j * (par[0] * type + 1)];
-		if (filter < 0 || filter > 4)
+		if (threadCreate(&ids[started], batchWorker, &b) == 0)
 		{
-			return -1;
-		}
-		for (int k = 1; k < par[0] * type + 1; k++)
-		{
-			out1[j * (par[0] * type + 1) + k] =
-				applyFilter(filter, out1[j * (par[0] * type + 1) + k], out1, 1, par, cnt, j * (par[0] * type + 1) + k, type);
-			cnt++;
-			if (out1[j * (par[0] * type + 1) + k] > buf.plteSize)
-			{
-				return -2;
-			}
-			for (int l = 0; l < 3; l++)
-			{
-				out2[x + l] = buf.plteData[out1[j * (par[0] * type + 1) + k] * 3 + l];
-			}
-			if (!isGrayScale(out2[x], out2[x + 1], out2[x + 2]))
-			{
-				*asP5 = 0;
-			}
-			x += 3;
+			started++;
 		}
 	}
-	if (*asP5 == 1 && buf.type == 3)
+	batchWorker(&b);
+	for (int t = 0; t < started; t++)
+	{
+		threadJoin(ids[t]);
+	}
+#if defined(__linux__)
+	if (batchIo != NULL)
+	{
+		// Lets the I/O thread finish the outputs still being written
+		atomic_store(&io.stop, 1);
+		ioWake(&io);
+		threadJoin(ioThread);
+		ioFree(&io);
+		batchIo = NULL;
+	}
+#endif
+	double seconds = now() - start;
+	faults = pageFaults() - faults;
+	free(poolDeques);
+	poolDeques = NULL;
+	poolWorkers = 0;
+	parkFree(&poolParking);
+	int ret = SUCCESS;
+	for (int j = 0; j < b.count; j++)
 	{
-		cnt = 0;
-		x = 0;
-		int i = 1;
-		while (i < size * type + par[1])
+		if (b.jobs[j].result.returnCode != SUCCESS)
 		{
-			out2[x] = buf.plteData[3 * out1[i]];
-			x++;
-			cnt++;
-			i++;
-			if (cnt % par[0] == 0)
-			{
-				i++;
-			}
+			fprintf(stderr, "%s: %s", b.jobs[j].input, b.jobs[j].result.text);
+			ret = ret == SUCCESS ? b.jobs[j].result.returnCode : ret;
 		}
 	}
-	return 0;
+	if (opt.stats)
+	{
+		printBatchStats(stdout, b.jobs, b.count, seconds, faults);
+	}
+	if (traceEnabled && writeTrace(opt.trace) != SUCCESS)
+	{
+		fprintf(stderr, "Cannot write trace file\n");
+		ret = ret == SUCCESS ? ERROR_UNKNOWN : ret;
+	}
+	free(b.jobs);
+	free(b.order);
+	free(b.deques);
+	free(ids);
+	return ret;
 }
-int convertRaw(int size, int type, int par[], unsigned char *out2, unsigned char *out1, struct image buf, int *asP5)
+#define STREAM_BUFFER ((size_t)1 << 20)
+// Converts every PNG of the input, - for standard input, into one stream of PNMs on the output, - for standard
+// output. PNM allows images one after another, so a pipeline can pass several images without temporary files.
+// Trace spans point to the stats of their job, so with --trace the jobs are kept until the trace is written
+int runStream(struct options opt)
 {
-	int x = 0;
-	int cnt = 0;
-	int i = 1;
-	unsigned char filter = out1[0];
-	if (buf.type == 3)
+	FILE *in = strcmp(opt.input, "-") == 0 ? stdin : fopen(opt.input, "rb");
+	FILE *out = strcmp(opt.output, "-") == 0 ? stdout : fopen(opt.output, "wb");
+	FILE *statsOut = out == stdout ? stderr : stdout;
+	int ret = in == NULL ? ERROR_CANNOT_OPEN_FILE : out == NULL ? ERROR_CANNOT_OPEN_FILE : SUCCESS;
+	if (ret != SUCCESS)
 	{
-		return palletRaw(size, type, par, out2, out1, buf, asP5);
+		fprintf(stderr, in == NULL ? "Cannot open input file\n" : "Cannot open output file\n");
+	}
+	else
+	{
+		setvbuf(in, NULL, _IOFBF, STREAM_BUFFER);
+		setvbuf(out, NULL, _IOFBF, STREAM_BUFFER);
 	}
-	while (i < size * type + par[1])
+	struct context ctx = { 0 };
+	struct job **jobs = NULL;
+	size_t kept = 0;
+	size_t capacity = 0;
+	for (size_t images = 0; ret == SUCCESS; images++)
 	{
-		for (int j = 0; j < type; j++)
+		int c = getc(in);
+		if (c == EOF && images > 0)
 		{
-			out2[x + j] = applyFilter(filter, out1[i + j], out2, 0, par, cnt, x + j, type);
+			break;
 		}
-		x += type;
-		i += type;
-		cnt++;
-		if (cnt % par[0] == 0)
+		ungetc(c, in);
+		struct job local = { 0 };
+		struct job *job = &local;
+		if (traceEnabled)
 		{
-			if (i < size * type + par[1] && (out1[i] < 0 || out1[i] > 4))
+			if (kept == capacity)
 			{
-				return -1;
+				size_t grown = capacity == 0 ? 64 : capacity * 2;
+				struct job **more = realloc(jobs, grown * sizeof(struct job *));
+				jobs = more != NULL ? more : jobs;
+				capacity = more != NULL ? grown : capacity;
+			}
+			job = kept < capacity ? calloc(1, sizeof(struct job)) : NULL;
+			if (job == NULL)
+			{
+				fprintf(stderr, "Not enough memory for trace\n");
+				ret = ERROR_OUT_OF_MEMORY;
+				break;
 			}
-			filter = out1[i];
-			i++;
+			jobs[kept++] = job;
+		}
+		*job = (struct job){ .input = opt.input, .output = opt.output, .source = in, .sink = out };
+		runJob(job, opt, &ctx);
+		if (opt.stats)
+		{
+			printJobStats(statsOut, job);
+		}
+		if ((*job).result.returnCode != SUCCESS)
+		{
+			fprintf(stderr, "%s", (*job).result.text);
+			ret = (*job).result.returnCode;
 		}
 	}
-	return 0;
-}
-void checkFree(unsigned char *f)
-{
-	if (f != NULL)
-	{
-		free(f);
-	}
-}
-int main(int argc, char *argv[])
-{
-	if (argc != 3)
-	{
-		fprintf(stderr, "Wrong number of arguments expected 2\n");
-		return ERROR_PARAMETER_INVALID;
-	}
-	int size = 8;
-	unsigned char data[9];
-	FILE *f = fopen(argv[1], "rb");
-	if (!f)
+	contextFree(&ctx);
+	if (traceEnabled && writeTrace(opt.trace) != SUCCESS)
 	{
-		fprintf(stderr, "Cannot open input file\n");
-		return ERROR_CANNOT_OPEN_FILE;
+		fprintf(stderr, "Cannot write trace file\n");
+		ret = ret == SUCCESS ? ERROR_UNKNOWN : ret;
 	}
-	int ret = fread(data, 1, size, f);
-	if (ret != size)
+	for (size_t i = 0; i < kept; i++)
 	{
-		fclose(f);
-		fprintf(stderr, "Wrong data in the file\n");
-		return ERROR_DATA_INVALID;
+		free(jobs[i]);
 	}
-	char str[16] = { data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] };
-	char sign[16] = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
-	if (strcmp(str, sign) != 0)
+	free(jobs);
+	if (in != NULL && in != stdin)
 	{
-		fclose(f);
-		fprintf(stderr, "Wrong png image signature\n");
-		return ERROR_DATA_INVALID;
+		fclose(in);
 	}
-	int par[2] = { 0, 0 };
-	struct image buf = { .data = NULL, 100 };
-	struct ihdrRet ans = ihdrChunk(f, &buf, par);
-	if (ans.returnCode != SUCCESS)
+	if (out != NULL && fclose(out) != 0 && ret == SUCCESS)
 	{
-		fclose(f);
-		fprintf(stderr, "%s", ans.text);
-		return ans.returnCode;
+		fprintf(stderr, "Cannot write output file\n");
+		ret = ERROR_UNKNOWN;
 	}
-	int type = ans.type;
-	size = par[0] * par[1];
-	buf.data = NULL;
-	buf.size = 0;
-	struct pair r = parsePNG(f, &buf);
-	if (r.returnCode != SUCCESS)
+	return ret;
+}
+int main(int argc, char *argv[])
+{
+	struct options opt = { .scale = 1, .threads = 1, .maxBytes = DEFAULT_MAX_BYTES };
+	struct pair p = parseOptions(argc, argv, &opt);
+	if (p.returnCode != SUCCESS)
 	{
-		fclose(f);
-		checkFree(buf.data);
-		checkFree(buf.plteData);
-		fprintf(stderr, "%s", r.text);
-		return r.returnCode;
+		fprintf(stderr, "%s", p.text);
+		return p.returnCode;
 	}
-	if (buf.size == 0)
+	countersEnabled = opt.counters;
+	traceEnabled = opt.trace != NULL && opt.daemon == NULL;
+	traceOrigin = now();
+	struct cache cache;
+	if (opt.cache != NULL)
 	{
-		fclose(f);
-		checkFree(buf.plteData);
-		fprintf(stderr, "No IDAT chunks found\n");
-		return ERROR_DATA_INVALID;
+		int ret = cacheOpen(&cache, opt);
+		if (ret != SUCCESS)
+		{
+			return ret;
+		}
+		conversionCache = &cache;
 	}
-	fclose(f);
-	unsigned char *out1 = malloc(sizeof(unsigned char) * size * type + par[1]);
-	if (!out1)
+	if (opt.daemon != NULL)
 	{
-		checkFree(buf.data);
-		checkFree(buf.plteData);
-		fprintf(stderr, "Not enough memory for decoded data\n");
-		return ERROR_OUT_OF_MEMORY;
+		return serve(opt);
 	}
-	ret = inf(buf.data, out1, buf.size, size * type + par[1]);
-	if (ret == ERROR_OUT_OF_MEMORY)
+	if (opt.batch)
 	{
-		checkFree(buf.data);
-		checkFree(buf.plteData);
-		free(out1);
-		fprintf(stderr, "Not enough memory to decompress\n");
-		return ret;
+		return runBatch(opt);
 	}
-	else if (ret == ERROR_DATA_INVALID)
+	if (opt.concatenated)
 	{
-		checkFree(buf.data);
-		checkFree(buf.plteData);
-		free(out1);
-		fprintf(stderr, "Wrong IDAT chunk data\n");
-		return ret;
+		return runStream(opt);
 	}
-	checkFree(buf.data);
-	unsigned char *out2;
-	out2 = malloc(sizeof(unsigned char) * size * type * (3 * (buf.type == 3) + 1));
-	if (!out2)
+	struct context ctx = { 0 };
+	struct job job = { .input = opt.input, .output = opt.output };
+	runJob(&job, opt, &ctx);
+	contextFree(&ctx);
+	if (opt.stats)
 	{
-		free(out1);
-		checkFree(buf.plteData);
-		fprintf(stderr, "Not enough memory for decoded data\n");
-		return ERROR_OUT_OF_MEMORY;
+		printJobStats(stdout, &job);
 	}
-	int asP5 = 1;
-	ret = convertRaw(size, type, par, out2, out1, buf, &asP5);
-	if (ret != 0)
+	if (job.result.returnCode != SUCCESS)
 	{
-		checkFree(out1);
-		checkFree(out2);
-		checkFree(buf.plteData);
-		if (ret == -1)
-		{
-			fprintf(stderr, "Unsupported filter, only support filter None\n");
-			return ERROR_UNSUPPORTED;
-		}
-		else
-		{
-			fprintf(stderr, "Pallet index greater than its size\n");
-			return ERROR_DATA_INVALID;
-		}
+		fprintf(stderr, "%s", job.result.text);
 	}
-	f = fopen(argv[2], "wb");
-	if (!f)
+	if (traceEnabled && writeTrace(opt.trace) != SUCCESS)
 	{
-		free(out1);
-		free(out2);
-		checkFree(buf.plteData);
-		fprintf(stderr, "Cannot open input file\n");
-		return ERROR_CANNOT_OPEN_FILE;
+		fprintf(stderr, "Cannot write trace file\n");
+		return job.result.returnCode == SUCCESS ? ERROR_UNKNOWN : job.result.returnCode;
 	}
-	writeToFile(f, out2, buf, asP5, size, type, par);
-	fclose(f);
-	checkFree(out1);
-	checkFree(out2);
-	checkFree(buf.plteData);
-	return SUCCESS;
+	return job.result.returnCode;
 }